@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <random>
+#include <vector>
+
+// best time of 'reps' runs of fn, in milliseconds
+static double bench(int reps, const std::function<void()>& fn)
+{
+    double best = std::numeric_limits<double>::max();
+    for (int r = 0; r < reps; r++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+static void report(const char* name, double ms, double items, const char* unit)
+{
+    printf("%-40s %9.2f ms %10.1f M%s/s\n", name, ms, items / ms / 1e3, unit);
+}
+
+// uniform noise in [0, 1), reproducible
+static std::vector<float> randomFloats(size_t n)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    std::vector<float> values(n);
+    for (float& v : values) {
+        v = dist(rng);
+    }
+    return values;
+}
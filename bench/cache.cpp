@@ -0,0 +1,52 @@
+// ImageCache throughput once it is full, each store evicting the least recently used entry
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "bench.hpp"
+#include "Image.hpp"
+#include "ImageCache.hpp"
+#include "globals.hpp"
+
+int main()
+{
+    // 10x10 8 bits images, 100 bytes each
+    const size_t w = 10, h = 10;
+    for (size_t n : {10000, 100000}) {
+        gCacheLimitMB = n * w * h / 1000000;
+        ImageCache::flush();
+
+        std::vector<std::shared_ptr<Image>> images(n);
+        for (auto& image : images) {
+            image = std::make_shared<Image>(calloc(w * h, 1), w, h, 1, SAMPLE_UINT8);
+        }
+        std::vector<std::string> keys(n), others(n);
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = "bench " + std::to_string(i);
+            others[i] = "other " + std::to_string(i);
+        }
+        // slightly less than the limit, so that the first round doesn't evict
+        for (size_t i = 0; i + 1 < n; i++) {
+            ImageCache::store(keys[i], images[i]);
+        }
+
+        std::string name = std::to_string(n) + " entries";
+        bool round = false;
+        report((name + ", store and evict").c_str(), bench(3, [&]() {
+            // alternate the key sets so that every store is new and evicts the oldest
+            const std::vector<std::string>& k = round ? keys : others;
+            for (size_t i = 0; i < n; i++) {
+                ImageCache::store(k[i], images[i]);
+            }
+            round = !round;
+        }), n, "stores");
+
+        const std::vector<std::string>& stored = round ? others : keys;
+        report((name + ", get").c_str(), bench(3, [&]() {
+            for (size_t i = 0; i < n; i++) {
+                ImageCache::get(stored[(i * 7919) % n]);
+            }
+        }), n, "gets");
+    }
+    return 0;
+}
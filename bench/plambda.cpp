@@ -0,0 +1,58 @@
+// plambda edits of 4K frames: the former path (compiling and evaluating the whole
+// frame on one thread, execute_plambda) against edit_images
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "bench.hpp"
+#include "Image.hpp"
+#include "editors.hpp"
+#include "globals.hpp"
+#include "plambda.h"
+
+int main()
+{
+    const size_t w = 3840, h = 2160, c = 3;
+    std::vector<float> a = randomFloats(w * h * c);
+    std::vector<float> b = randomFloats(w * h * c);
+    std::shared_ptr<void> owner(a.data(), [](void*) {});
+    std::vector<std::shared_ptr<Image>> images = {
+        std::make_shared<Image>(owner, a.data(), w, h, c, SAMPLE_FLOAT32),
+        std::make_shared<Image>(owner, b.data(), w, h, c, SAMPLE_FLOAT32),
+    };
+    double samples = w * h * c;
+
+    struct { const char* prog; int n; } cases[] = {{"x y -", 2}, {"x(1,0) x -", 1}};
+    for (const auto& cs : cases) {
+        const char* prog = cs.prog;
+        int n = cs.n;
+        std::string name = std::string("'") + prog + "'";
+        std::vector<std::shared_ptr<Image>> inputs(images.begin(), images.begin() + n);
+
+        report((name + ", execute_plambda").c_str(), bench(3, [&]() {
+            float* x[2] = {a.data(), b.data()};
+            int ws[2] = {(int) w, (int) w};
+            int hs[2] = {(int) h, (int) h};
+            int ds[2] = {(int) c, (int) c};
+            int od;
+            char* error;
+            std::vector<char> program(prog, prog + strlen(prog) + 1);
+            free(execute_plambda(n, x, ws, hs, ds, program.data(), &od, &error));
+        }), samples, "samples");
+
+        gIdleLoaders = 0;
+        report((name + ", edit_images, 1 thread").c_str(), bench(3, [&]() {
+            std::string error;
+            edit_images(PLAMBDA, prog, inputs, error);
+        }), samples, "samples");
+
+        gIdleLoaders = std::thread::hardware_concurrency();
+        report((name + ", edit_images, idle loaders").c_str(), bench(3, [&]() {
+            std::string error;
+            edit_images(PLAMBDA, prog, inputs, error);
+        }), samples, "samples");
+    }
+    return 0;
+}
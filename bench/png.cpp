@@ -0,0 +1,84 @@
+// PNGFileImageProvider on 16 bits 4K frames, against a plain libpng read of the same file
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+#include "bench.hpp"
+#include "ImageProvider.hpp"
+
+static void writePNG(const char* filename, const std::vector<uint16_t>& samples,
+                     size_t w, size_t h, bool interlaced)
+{
+    FILE* file = fopen(filename, "wb");
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    png_init_io(png_ptr, file);
+    png_set_IHDR(png_ptr, info_ptr, w, h, 16, PNG_COLOR_TYPE_RGB,
+                 interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    png_set_swap(png_ptr);
+    std::vector<png_bytep> rows(h);
+    for (size_t y = 0; y < h; y++) {
+        rows[y] = (png_bytep) &samples[y * w * 3];
+    }
+    png_write_image(png_ptr, rows.data());
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(file);
+}
+
+static void readPNG(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    png_init_io(png_ptr, file);
+    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_SWAP_ENDIAN, NULL);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(file);
+}
+
+int main()
+{
+    const size_t w = 3840, h = 2160;
+    // a smooth gradient with some noise, compressing roughly like a photograph
+    std::vector<float> noise = randomFloats(w * h * 3);
+    std::vector<uint16_t> samples(w * h * 3);
+    for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+            for (size_t d = 0; d < 3; d++) {
+                size_t i = (y * w + x) * 3 + d;
+                samples[i] = (uint16_t) (x * 8 + y * 4 * d + noise[i] * 256);
+            }
+        }
+    }
+    double pixels = w * h;
+
+    for (bool interlaced : {false, true}) {
+        const char* filename = interlaced ? "bench_png_interlaced.png" : "bench_png.png";
+        writePNG(filename, samples, w, h, interlaced);
+        std::string name = interlaced ? "interlaced, " : "";
+
+        report((name + "libpng png_read_png").c_str(), bench(3, [&]() {
+            readPNG(filename);
+        }), pixels, "pixels");
+
+        report((name + "PNGFileImageProvider").c_str(), bench(3, [&]() {
+            PNGFileImageProvider provider(filename);
+            while (!provider.isLoaded()) {
+                provider.progress();
+            }
+            if (!provider.getResult().has_value()) {
+                fprintf(stderr, "%s\n", provider.getResult().error().c_str());
+            }
+        }), pixels, "pixels");
+
+        remove(filename);
+    }
+    return 0;
+}
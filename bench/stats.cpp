@@ -0,0 +1,67 @@
+// statistics computed by the Image constructor, against the two-pass scalar loop it replaced
+#include <cmath>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "bench.hpp"
+#include "Image.hpp"
+#include "globals.hpp"
+
+static void scalarMinMax(const float* pixels, size_t n, float& min, float& max)
+{
+    min = std::numeric_limits<float>::max();
+    max = std::numeric_limits<float>::lowest();
+    for (size_t i = 0; i < n; i++) {
+        float v = pixels[i];
+        min = std::min(min, v);
+        max = std::max(max, v);
+    }
+    if (!std::isfinite(min) || !std::isfinite(max)) {
+        min = std::numeric_limits<float>::max();
+        max = std::numeric_limits<float>::lowest();
+        for (size_t i = 0; i < n; i++) {
+            float v = pixels[i];
+            if (std::isfinite(v)) {
+                min = std::min(min, v);
+                max = std::max(max, v);
+            }
+        }
+    }
+}
+
+int main()
+{
+    const size_t w = 4096, h = 4096;
+    for (size_t c : {1, 3, 4}) {
+        for (bool nans : {false, true}) {
+            std::vector<float> pixels = randomFloats(w * h * c);
+            if (nans) {
+                for (size_t i = 0; i < pixels.size(); i += 1000) {
+                    pixels[i] = NAN;
+                }
+            }
+            std::string name = std::to_string(w) + "x" + std::to_string(h) + "x" + std::to_string(c)
+                               + (nans ? " with nans" : "");
+            double samples = pixels.size();
+            // the pixels stay owned by the vector
+            std::shared_ptr<void> owner(pixels.data(), [](void*) {});
+
+            float min, max;
+            report((name + ", scalar").c_str(), bench(5, [&]() {
+                scalarMinMax(pixels.data(), pixels.size(), min, max);
+            }), samples, "samples");
+
+            gIdleLoaders = 0;
+            report((name + ", Image, 1 thread").c_str(), bench(5, [&]() {
+                Image image(owner, pixels.data(), w, h, c, SAMPLE_FLOAT32);
+            }), samples, "samples");
+
+            gIdleLoaders = std::thread::hardware_concurrency();
+            report((name + ", Image, idle loaders").c_str(), bench(5, [&]() {
+                Image image(owner, pixels.data(), w, h, c, SAMPLE_FLOAT32);
+            }), samples, "samples");
+        }
+    }
+    return 0;
+}
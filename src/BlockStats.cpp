@@ -0,0 +1,176 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "Image.hpp"
+#include "Histogram.hpp"
+#include "BlockStats.hpp"
+
+#define BLOCK_SIZE 64
+
+BlockStats::BlockStats()
+    : loaded(true), ready(false), nbx(0), nby(0), c(0), min(0), max(0), nbins(0), curby(0)
+{
+}
+
+void BlockStats::request(const std::shared_ptr<Image>& image)
+{
+    // the blocks of a tiled image would need all of it to be decoded
+    if (ready || !loaded || image->tiles)
+        return;
+    this->image = image;
+    loaded = false;
+}
+
+float BlockStats::getProgressPercentage() const
+{
+    if (loaded) return 1.f;
+    if (!nby) return 0.f;
+    return (float) curby / nby;
+}
+
+void BlockStats::progress()
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image) {
+        loaded = true;
+        return;
+    }
+
+    if (!nbx) {
+        nbx = (image->w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        nby = (image->h + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        c = image->c;
+        min = image->min;
+        max = image->max;
+        nbins = image->histogram->nbins;
+        mins.assign(nbx * nby * c, std::numeric_limits<float>::max());
+        maxs.assign(nbx * nby * c, std::numeric_limits<float>::lowest());
+        bins.assign(nbx * nby * c * nbins, 0);
+        curby = 0;
+    }
+
+    // one row of blocks per call
+    float f = (nbins-1) / (max - min);
+    std::vector<float> row(image->w * c);
+    size_t y0 = curby * BLOCK_SIZE;
+    size_t y1 = std::min(image->h, y0 + BLOCK_SIZE);
+    for (size_t y = y0; y < y1; y++) {
+        image->getSamples(y * image->w * c, row.size(), 1, row.data());
+        for (size_t x = 0; x < image->w; x++) {
+            size_t block = curby * nbx + x / BLOCK_SIZE;
+            for (size_t d = 0; d < c; d++) {
+                float v = row[x * c + d];
+                size_t i = block * c + d;
+                if (std::isfinite(v)) {
+                    mins[i] = std::min(mins[i], v);
+                    maxs[i] = std::max(maxs[i], v);
+                }
+                // same binning as Histogram::progress
+                float t = (v - min) * f;
+                if (t >= 0.f && t < nbins) {
+                    bins[i * nbins + (int) t]++;
+                }
+            }
+        }
+    }
+
+    curby++;
+    if (curby == nby) {
+        ready = true;
+        loaded = true;
+    }
+}
+
+// calls inside(bx, by) for the blocks completely in the region
+// and border(rect) for the parts of the region that are not covered by such blocks
+template <typename Inside, typename Border>
+static void forEachBlock(const Image& image, ImRect region, Inside inside, Border border)
+{
+    size_t x0 = region.Min.x;
+    size_t y0 = region.Min.y;
+    size_t x1 = region.Max.x;
+    size_t y1 = region.Max.y;
+    for (size_t by = y0 / BLOCK_SIZE; by * BLOCK_SIZE < y1; by++) {
+        for (size_t bx = x0 / BLOCK_SIZE; bx * BLOCK_SIZE < x1; bx++) {
+            ImRect block(bx * BLOCK_SIZE, by * BLOCK_SIZE,
+                         std::min(image.w, (bx + 1) * BLOCK_SIZE), std::min(image.h, (by + 1) * BLOCK_SIZE));
+            if (region.Contains(block)) {
+                inside(bx, by);
+            } else {
+                block.ClipWithFull(region);
+                border(block);
+            }
+        }
+    }
+}
+
+// calls fn(row, n) for each row of the rect, with all the bands of its pixels
+template <typename Fn>
+static void forEachRow(const Image& image, ImRect rect, Fn fn)
+{
+    size_t w = rect.GetWidth();
+    std::vector<float> row(w * image.c);
+    for (size_t y = rect.Min.y; y < rect.Max.y; y++) {
+        image.getSamples((y * image.w + (size_t) rect.Min.x) * image.c, row.size(), 1, row.data());
+        fn(row.data(), w);
+    }
+}
+
+bool BlockStats::getRange(const Image& image, ImRect region, const std::vector<size_t>& bands,
+                          float& low, float& high) const
+{
+    if (!ready)
+        return false;
+
+    forEachBlock(image, region, [&](size_t bx, size_t by) {
+        for (size_t b : bands) {
+            size_t i = (by * nbx + bx) * c + b;
+            low = std::min(low, mins[i]);
+            high = std::max(high, maxs[i]);
+        }
+    }, [&](ImRect rect) {
+        forEachRow(image, rect, [&](const float* row, size_t w) {
+            for (size_t x = 0; x < w; x++) {
+                for (size_t b : bands) {
+                    float v = row[x * c + b];
+                    if (std::isfinite(v)) {
+                        low = std::min(low, v);
+                        high = std::max(high, v);
+                    }
+                }
+            }
+        });
+    });
+    return true;
+}
+
+bool BlockStats::getHistogram(const Image& image, ImRect region, float min, float max, int nbins,
+                              std::vector<std::vector<long>>& values) const
+{
+    if (!ready || min != this->min || max != this->max || nbins != this->nbins)
+        return false;
+
+    float f = (nbins-1) / (max - min);
+    forEachBlock(image, region, [&](size_t bx, size_t by) {
+        for (size_t d = 0; d < c; d++) {
+            const uint16_t* b = &bins[((by * nbx + bx) * c + d) * nbins];
+            for (int i = 0; i < nbins; i++) {
+                values[d][i] += b[i];
+            }
+        }
+    }, [&](ImRect rect) {
+        forEachRow(image, rect, [&](const float* row, size_t w) {
+            for (size_t x = 0; x < w; x++) {
+                for (size_t d = 0; d < c; d++) {
+                    float t = (row[x * c + d] - min) * f;
+                    if (t >= 0.f && t < nbins) {
+                        values[d][(int) t]++;
+                    }
+                }
+            }
+        });
+    });
+    return true;
+}
+
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+#include "imgui.h"
+#define IMGUI_DEFINE_MATH_OPERATORS
+#include "imgui_internal.h"
+
+#include "Progressable.hpp"
+
+struct Image;
+
+// min/max and histogram of each block of an image
+// region queries combine the blocks inside the region and only read the pixels of the border blocks
+// built on the compute thread when first requested
+class BlockStats : public Progressable {
+    std::weak_ptr<Image> image;
+    std::atomic<bool> loaded;
+    std::atomic<bool> ready;
+
+    size_t nbx, nby, c;
+    // binning of the histograms, same as the Histogram of the image
+    float min, max;
+    int nbins;
+    // indexed by (block*c + band)
+    std::vector<float> mins, maxs;
+    std::vector<uint16_t> bins;
+    size_t curby;
+
+public:
+    BlockStats();
+
+    void request(const std::shared_ptr<Image>& image);
+
+    // false if the blocks are not built yet
+    bool getRange(const Image& image, ImRect region, const std::vector<size_t>& bands,
+                  float& low, float& high) const;
+    // adds the histogram of the region to 'values', if the binning matches
+    bool getHistogram(const Image& image, ImRect region, float min, float max, int nbins,
+                      std::vector<std::vector<long>>& values) const;
+
+    float getProgressPercentage() const;
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void progress();
+};
+
@@ -7,6 +7,7 @@
 #include "Colormap.hpp"
 #include "View.hpp"
 #include "Image.hpp"
+#include "Pyramid.hpp"
 #include "DisplayArea.hpp"
 #include "shaders.hpp"
 
@@ -33,7 +34,14 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         ImVec2 imSize(image->w, image->h);
         ImVec2 p1 = view->window2image(ImVec2(0, 0), imSize, winSize, factor);
         ImVec2 p2 = view->window2image(winSize, imSize, winSize, factor);
-        requestTextureArea(image, ImRect(p1, p2), colormap->bands);
+        // each level of the pyramid halves the resolution
+        int level = 0;
+        float scale = view->zoom * factor;
+        int maxlevel = Pyramid::getMaxLevel(*image);
+        while (level < maxlevel && scale * (1 << (level + 1)) <= 1.f) {
+            level++;
+        }
+        requestTextureArea(image, ImRect(p1, p2), colormap->bands, level);
     }
 
     // draw a checkboard pattern
@@ -51,11 +59,19 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
     ImGui::ShaderUserData* userdata = new ImGui::ShaderUserData;
     userdata->shader = colormap->shader;
     userdata->scale = colormap->getScale();
+    // 8 and 16 bits textures are sampled in [0,1]
+    for (auto& s : userdata->scale) {
+        s *= texture.getSampleScale();
+    }
     userdata->bias = colormap->getBias();
     ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, userdata);
+    float s = 1 << loadedLevel;
     for (auto t : texture.tiles) {
-        ImVec2 TL = view->image2window(ImVec2(t.x, t.y), getCurrentSize(), winSize, factor);
-        ImVec2 BR = view->image2window(ImVec2(t.x+t.w, t.y+t.h), getCurrentSize(), winSize, factor);
+        // the pixels of new tiles are still on their way
+        if (!t.ready) continue;
+
+        ImVec2 TL = view->image2window(ImVec2(t.x, t.y) * s, getCurrentSize(), winSize, factor);
+        ImVec2 BR = view->image2window(ImVec2(t.x+t.w, t.y+t.h) * s, getCurrentSize(), winSize, factor);
 
         TL += pos;
         BR += pos;
@@ -70,35 +86,86 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
     ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, NULL);
 }
 
-void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, BandIndices bandidx)
+void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect,
+                                     BandIndices bandidx, int level)
 {
+    // use the level matching the zoom, or a coarser one while it is being built
+    std::shared_ptr<Image> source = image;
+    int found = 0;
+    if (level > 0) {
+        source = nullptr;
+        for (found = level; found <= Pyramid::getMaxLevel(*image) && !source; found++) {
+            source = image->pyramid->getLevel(*image, found);
+        }
+        found--;
+        if (!source || found != level) {
+            image->pyramid->request(image, level);
+        }
+        if (!source) {
+            if (image->tiles) {
+                // nothing new to show until the first levels are built
+                if (this->image != image) {
+                    this->image = image;
+                    this->source = nullptr;
+                    loadedRect = ImRect();
+                    texture.clear();
+                }
+                return;
+            }
+            // during a playback zoomed out, keep showing the level of the previous frame
+            // rather than uploading the new one at full resolution and then again at its level
+            if (this->image != image && this->source && loadedLevel > 0) {
+                return;
+            }
+            source = image;
+            found = 0;
+        }
+    }
+
+    rect.Min /= (float) (1 << found);
+    rect.Max /= (float) (1 << found);
     rect.Expand(1.0f);
     rect.Floor();
-    rect.ClipWithFull(ImRect(0, 0, image->w, image->h));
-
-    bool reupload = false;
-
-    if (this->image != image) {
-        this->image = image;
-        loadedRect = ImRect();
+    rect.ClipWithFull(ImRect(0, 0, source->w, source->h));
+
+    bool changed = this->image != image || this->source != source;
+    ImRect area = changed ? ImRect() : loadedRect;
+    bool reupload = changed || loadedBands != bandidx;
+
+    if (!area.Contains(rect)) {
+        // tiled images are only decoded around the visible area, the others accumulate
+        if (image->tiles) {
+            area = rect;
+        } else {
+            area.Add(rect);
+        }
+        area.Expand(128);  // to avoid multiple uploads during zoom-out
+        area.ClipWithFull(ImRect(0, 0, source->w, source->h));
         reupload = true;
     }
 
-    if (!loadedRect.Contains(rect)) {
-        loadedRect.Add(rect);
-        loadedRect.Expand(128);  // to avoid multiple uploads during zoom-out
-        loadedRect.ClipWithFull(ImRect(0, 0, image->w, image->h));
-        reupload = true;
+    if (!reupload) {
+        return;
     }
 
-    if (loadedBands != bandidx) {
-        loadedBands = bandidx;
-        reupload = true;
+    // the tiles are decoded by the loading threads, meanwhile the texture
+    // keeps what it shows (e.g. a coarser level) if it is the same image
+    if (source->tiles && !source->requestTiles(area.Min.x, area.Min.y, area.Max.x, area.Max.y)) {
+        if (this->image != image) {
+            this->image = image;
+            this->source = nullptr;
+            loadedRect = ImRect();
+            texture.clear();
+        }
+        return;
     }
 
-    if (reupload) {
-        texture.upload(image, loadedRect, loadedBands);
-    }
+    this->image = image;
+    this->source = source;
+    loadedLevel = found;
+    loadedRect = area;
+    loadedBands = bandidx;
+    texture.upload(source, loadedRect, loadedBands);
 }
 
 ImVec2 DisplayArea::getCurrentSize() const
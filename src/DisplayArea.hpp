@@ -14,11 +14,14 @@ class DisplayArea {
     Texture texture;
 
     std::shared_ptr<Image> image;
+    // the image or one of its pyramid levels, this is what the texture contains
+    std::shared_ptr<Image> source;
+    int loadedLevel;
     ImRect loadedRect;
     BandIndices loadedBands;
 
 public:
-    DisplayArea() : image(nullptr), loadedBands(BANDS_DEFAULT) {
+    DisplayArea() : image(nullptr), source(nullptr), loadedLevel(0), loadedBands(BANDS_DEFAULT) {
     }
 
     void draw(const std::shared_ptr<Image>& image, ImVec2 pos,
@@ -26,7 +29,8 @@ public:
     ImVec2 getCurrentSize() const;
 
 private:
-    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, BandIndices bandidx);
+    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect,
+                            BandIndices bandidx, int level);
 
 };
 
@@ -1,5 +1,3 @@
-#include <regex>
-
 #include "imgui.h"
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include "imgui_internal.h"
@@ -9,6 +7,14 @@
 #include "Player.hpp"
 #include "globals.hpp"
 #include "EditGUI.hpp"
+#include "Image.hpp"
+
+// images smaller than this are edited at full resolution directly
+#define PREVIEW_MIN_PIXELS (1<<20)
+// above this size the preview uses 1/8 of the resolution instead of 1/4
+#define PREVIEW_COARSE_PIXELS (16<<20)
+// seconds without change of a variable before the full resolution is computed
+#define PREVIEW_REFINE_DELAY 0.3
 
 void EditGUI::display(Sequence& seq, bool focus)
 {
@@ -30,22 +36,48 @@ void EditGUI::display(Sequence& seq, bool focus)
         shouldValidate = true;
     }
 
+    bool dragged = false;
+    bool active = false;
     for (int i = 0; i < nvars; i++) {
         std::string name = "$" + std::to_string(i+1);
         if (ImGui::DragFloat(("##"+name).c_str(), &vars[i], 1.f, 0.f, 0.f, (name+": %.3f").c_str())) {
-            shouldValidate = true;
+            dragged = true;
         }
+        active |= ImGui::IsItemActive();
     }
 
     if (shouldValidate) {
         validate(seq);
+    } else if (dragged) {
+        validate(seq, getPreviewScale(seq));
+        lastChange = ImGui::GetTime();
+    } else if (seq.previewScale > 1
+               && (!active || ImGui::GetTime() - lastChange > PREVIEW_REFINE_DELAY)) {
+        validate(seq);
+    }
+    if (seq.previewScale > 1) {
+        gActive = std::max(gActive, 2);
     }
 }
 
-void EditGUI::validate(Sequence& seq)
+int EditGUI::getPreviewScale(const Sequence& seq) const
+{
+    std::shared_ptr<Image> image = seq.image;
+    if (!image)
+        return 4;
+    size_t npixels = image->w * image->h * seq.imageScale * seq.imageScale;
+    if (npixels < PREVIEW_MIN_PIXELS)
+        return 1;
+    if (npixels >= PREVIEW_COARSE_PIXELS)
+        return 8;
+    return 4;
+}
+
+void EditGUI::validate(Sequence& seq, int downscale)
 {
     if (!editprog[0]) {
         seq.collection = seq.uneditedCollection;
+        downscale = 1;
         nvars = 0;
     } else {
         std::string prog(editprog);
@@ -57,17 +89,25 @@ void EditGUI::validate(Sequence& seq)
         }
 
         for (int i = 0; i < nvars; i++) {
+            std::string n = "$" + std::to_string(i+1);
             std::string val = std::to_string(vars[i]);
-            prog = std::regex_replace(prog, std::regex("\\$" + std::to_string(i+1)), val);
+            for (size_t pos = prog.find(n); pos != std::string::npos; pos = prog.find(n, pos + val.size())) {
+                prog.replace(pos, n.size(), val);
+            }
         }
 
-        ImageCollection* collection = create_edited_collection(edittype, prog);
+        ImageCollection* collection = create_edited_collection(edittype, prog, downscale);
         if (collection) {
             seq.collection = collection;
+        } else {
+            downscale = 1;
         }
     }
 
-    seq.forgetImage();
+    // a preview replaces the current image only once it is computed
+    bool preview = downscale > 1 || seq.previewScale > 1;
+    seq.previewScale = downscale;
+    seq.forgetImage(preview);
     if (seq.player)
         seq.player->reconfigureBounds();
 }
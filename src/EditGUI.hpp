@@ -9,19 +9,24 @@ class Sequence;
 class EditGUI {
     float vars[MAX_VARS];
     int nvars;
+    // time of the last change of a variable, the preview is refined when they settle
+    double lastChange;
+
+    int getPreviewScale(const Sequence& seq) const;
 
 public:
     char editprog[4096];
     EditType edittype;
 
-    EditGUI() : nvars(0), editprog(""), edittype(PLAMBDA) {
+    EditGUI() : nvars(0), lastChange(0), editprog(""), edittype(PLAMBDA) {
         for (int i = 0; i < MAX_VARS; i++)
             vars[i] = 0;
     }
 
     void display(Sequence& seq, bool focus);
 
-    void validate(Sequence& seq);
+    // downscale > 1 builds a quick preview, displayed over the current image until it is ready
+    void validate(Sequence& seq, int downscale=1);
 
     bool isEditing() const {
         return editprog[0];
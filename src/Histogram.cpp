@@ -4,40 +4,35 @@
 
 #include "imgui_custom.hpp"
 
+#include <functional>
+
 #include "Image.hpp"
 #include "Colormap.hpp"
 #include "globals.hpp"
 #include "Histogram.hpp"
+#include "BlockStats.hpp"
+#include "parallel.hpp"
 
 namespace imscript {
-    // a quad is a square cell bounded by 4 pixels
-    // it knows its four values and its position on the original image
-    struct quad {
-        float abcd[4];
-        int ij;
-    };
-
-    static int compare_floats(const void *a, const void *b)
-    {
-        const float *da = (const float *) a;
-        const float *db = (const float *) b;
-        return (*da > *db) - (*da < *db);
-    }
+    // a cell is a square bounded by 4 pixels, its values are sorted
+    // and its contribution is added to the 2nd derivative of the histogram
 
-    static void sort_four_values(float *x)
+    static inline void compare_and_swap(float& a, float& b)
     {
-        qsort(x, 4, sizeof*x, compare_floats);
+        float lo = std::min(a, b);
+        float hi = std::max(a, b);
+        a = lo;
+        b = hi;
     }
 
-    // copy the values of a square cell into an array, for easy access
-    static void copy_cell_values(float q[4], float *x, int w, int h, int c, int i, int j)
+    // branchless sorting network for 4 values
+    static inline void sort_four_values(float *x)
     {
-        assert(0 <= i); assert(i < w - 1);
-        assert(0 <= j); assert(j < h - 1);
-        q[0] = x[ ((j+0)*w + (i+0))*c ];
-        q[1] = x[ ((j+0)*w + (i+1))*c ];
-        q[2] = x[ ((j+1)*w + (i+0))*c ];
-        q[3] = x[ ((j+1)*w + (i+1))*c ];
+        compare_and_swap(x[0], x[1]);
+        compare_and_swap(x[2], x[3]);
+        compare_and_swap(x[0], x[2]);
+        compare_and_swap(x[1], x[3]);
+        compare_and_swap(x[1], x[2]);
     }
 
     // obtain the histogram bin that corresponds to the given value
@@ -57,16 +52,14 @@ namespace imscript {
         return !(q[0] < q[1] && q[1] < q[2] && q[2] < q[3]);
     }
 
-    static void integrate_values(long double (*o)[2], int n)
+    static void integrate_values(double *o, int n)
     {
         // TODO : multiply each increment by the span of the interval
         for (int i = 1; i < n; i++)
-            o[i][1] += o[i-1][1];// * (o[i][0] - o[i-1][0]);
-        //o[0][1] = 0;
+            o[i] += o[i-1];
     }
 
-    static void accumulate_jumps_for_one_cell(long double (*o)[2],
-                                              int n, float m, float M, float q[4])
+    static void accumulate_jumps_for_one_cell(double *o, int n, float m, float M, float q[4])
     {
         // discard degenerate cells
         if (cell_is_degenerate(m, M, q))
@@ -92,44 +85,11 @@ namespace imscript {
         assert(i_B < i_C);
         assert(i_C < i_D);
 
-        double fac = 1;//33333;
-
         // accumulate jumps
-        o[ i_A ][1] += fac * 2 / (C + D - B - A) / (B - A);
-        o[ i_B ][1] -= fac * 2 / (C + D - B - A) / (B - A);
-        o[ i_C ][1] -= fac * 2 / (C + D - B - A) / (D - C);
-        o[ i_D ][1] += fac * 2 / (C + D - B - A) / (D - C);
-    }
-
-    static void fill_continuous_histogram_simple(
-                                          long double (*o)[2], // output histogram array of (value,density) pairs
-                                          int n,               // requested number of bins for the histogram
-                                          float m,             // requested minimum of the histogram
-                                          float M,             // requested maximum of the histogram
-                                          float *x,            // input image data
-                                          int w,               // input image width
-                                          int h,                // input image height
-                                          int c
-                                         )
-    {
-        // initialize bins (n equidistant points between m and M)
-        for (int i = 0; i < n; i++) {
-            o[i][0] = m + i * (M - m) / n;
-            o[i][1] = 0;
-        }
-
-        // compute 2nd derivative of histogram
-        for (int j = 0; j < h - 1; j++)
-            for (int i = 0; i < w - 1; i++) {
-                float q[4]; // here we store the 4 values of the cell at (i,j)
-                copy_cell_values(q, x, w, h, c, i, j);
-                sort_four_values(q);
-                accumulate_jumps_for_one_cell(o, n, m, M, q);
-            }
-
-        // integrate twice
-        integrate_values(o, n);
-        integrate_values(o, n);
+        o[ i_A ] += 2 / (C + D - B - A) / (B - A);
+        o[ i_B ] -= 2 / (C + D - B - A) / (B - A);
+        o[ i_C ] -= 2 / (C + D - B - A) / (D - C);
+        o[ i_D ] += 2 / (C + D - B - A) / (D - C);
     }
 }
 
@@ -138,12 +98,18 @@ void Histogram::request(std::shared_ptr<Image> image, Mode mode, ImRect region)
     std::shared_ptr<Image> img = this->image.lock();
     float min = image->min;
     float max = image->max;
+    // the smooth histogram needs all the samples in memory
+    if (image->tiles)
+        mode = EXACT;
     if (region.Min.x == 0 && region.Min.y == 0 && region.Max.x == 0 && region.Max.y == 0) {
         region.Max.x = image->w;
         region.Max.y = image->h;
     }
     if (image == img && min == this->min && max == this->max && mode == this->mode && region == this->region)
         return;
+    // the regions of a selection move a lot, the blocks make them cheap
+    if (!(region == ImRect(0, 0, image->w, image->h)))
+        image->blocks->request(image);
     loaded = false;
     this->mode = mode;
     this->min = min;
@@ -151,9 +117,11 @@ void Histogram::request(std::shared_ptr<Image> image, Mode mode, ImRect region)
     this->image = image;
     this->region = region;
     curh = 0;
+    generation++;
 
     values.clear();
     values.resize(image->c);
+    jumps.assign(image->c, std::vector<double>(nbins));
 
     for (size_t d = 0; d < image->c; d++) {
         auto& histogram = values[d];
@@ -169,62 +137,175 @@ float Histogram::getProgressPercentage() const {
     return (float) curh / region.GetHeight();
 }
 
+// samples binned by each call to progress(), shared between the threads
+#define SAMPLES_PER_STEP (1 << 22)
+// a thread is not worth it for less than this
+#define SAMPLES_PER_THREAD (1 << 18)
+
+// bins of the rows [y0, y1) of the region, one table per band
+// out of range and non-finite samples go to the extra bin 'nbins'
+static void fillBins(const Image& image, size_t minx, size_t maxx, size_t y0, size_t y1,
+                     float min, float max, int nbins, std::vector<std::vector<long>>& bins)
+{
+    size_t c = image.c;
+    size_t n = (maxx - minx) * c;
+    // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
+    float f = (nbins-1) / (max - min);
+    std::vector<float> row(n);
+    std::vector<int> indices(n);
+    for (size_t y = y0; y < y1; y++) {
+        image.getSamples((y*image.w + minx)*c, n, 1, row.data());
+        // separate loop without dependencies so that it can be vectorized
+        for (size_t i = 0; i < n; i++) {
+            float t = (row[i] - min) * f;
+            indices[i] = (t >= 0.f && t < nbins) ? (int) t : nbins;
+        }
+        for (size_t i = 0; i < n; i += c) {
+            for (size_t d = 0; d < c; d++) {
+                bins[d][indices[i+d]]++;
+            }
+        }
+    }
+}
+
+// jumps of the cells whose top-left corner is on the rows [y0, y1) of the region
+static void fillJumps(const Image& image, size_t minx, size_t maxx, size_t y0, size_t y1,
+                      float min, float max, int nbins, std::vector<std::vector<double>>& jumps)
+{
+    size_t c = image.c;
+    size_t n = (maxx - minx) * c;
+    std::vector<float> top(n);
+    std::vector<float> bottom(n);
+    image.getSamples((y0*image.w + minx)*c, n, 1, top.data());
+    for (size_t y = y0; y < y1; y++) {
+        image.getSamples(((y+1)*image.w + minx)*c, n, 1, bottom.data());
+        for (size_t i = 0; i + c < n; i += c) {
+            for (size_t d = 0; d < c; d++) {
+                float q[4] = {top[i+d], top[i+c+d], bottom[i+d], bottom[i+c+d]};
+                imscript::sort_four_values(q);
+                imscript::accumulate_jumps_for_one_cell(jumps[d].data(), nbins, min, max, q);
+            }
+        }
+        top.swap(bottom);
+    }
+}
+
+// split the rows [y0, y1) between the threads of the shared pool
+// job(t, start, end) gets the index of its part
+static size_t countThreads(size_t rows, size_t rowsamples)
+{
+    return parallel_chunks(rows, SAMPLES_PER_THREAD / std::max(rowsamples, (size_t) 1));
+}
+
+static void runThreads(size_t nthreads, size_t y0, size_t y1,
+                       const std::function<void(size_t,size_t,size_t)>& job)
+{
+    parallel_for(y1 - y0, nthreads, [&](size_t t, size_t start, size_t end) {
+        job(t, y0 + start, y0 + end);
+    });
+}
+
 void Histogram::progress()
 {
-    std::vector<std::vector<long>> valuescopy;
-    size_t oldh;
+    std::shared_ptr<Image> image;
+    Mode mode;
+    float min, max;
+    ImRect region;
+    size_t y0;
+    uint64_t generation;
     {
         std::lock_guard<std::recursive_mutex> _lock(lock);
-        valuescopy = values;
-        oldh = curh;
+        image = this->image.lock();
+        mode = this->mode;
+        min = this->min;
+        max = this->max;
+        region = this->region;
+        y0 = curh;
+        generation = this->generation;
     }
-
-    std::shared_ptr<Image> image = this->image.lock();
     if (!image) return;
 
-    if (mode == EXACT) {
-        size_t minh = region.Min.y;
-        size_t minx = region.Min.x;
-        size_t maxx = region.Max.x;
-        for (size_t d = 0; d < image->c; d++) {
-            auto& histogram = valuescopy[d];
-            // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
-            float f = (nbins-1) / (max - min);
-            for (size_t i = minx; i < maxx; i++) {
-                // TODO: sometimes it crashes here
-                int bin = (image->pixels[((minh+curh)*image->w + i)*image->c+d] - min) * f;
-                if (bin >= 0 && bin < nbins) {
-                    histogram[bin]++;
-                }
-            }
-        }
-    } else if (mode == SMOOTH) {
-        long double bins[3+nbins][2];
-        for (size_t d = 0; d < image->c; d++) {
-            imscript::fill_continuous_histogram_simple(bins, nbins, min, max, image->pixels+d, image->w, image->h, image->c);
-            for (int b = 0; b < nbins; b++) {
-                valuescopy[d][b] = bins[b][1];
+    // the smooth histogram works on cells, so it has one row less
+    size_t height = region.GetHeight();
+    size_t rowsToDo = mode == SMOOTH ? std::max(height, (size_t) 1) - 1 : height;
+    if (y0 >= rowsToDo) {
+        curh = height;
+        loaded = true;
+        return;
+    }
+
+    size_t minx = region.Min.x;
+    size_t maxx = region.Max.x;
+    size_t miny = region.Min.y;
+    size_t rowsamples = std::max((size_t) 1, (maxx - minx) * image->c);
+    // the smooth kernel is a lot more expensive per sample
+    size_t samples = mode == SMOOTH ? SAMPLES_PER_STEP / 16 : SAMPLES_PER_STEP;
+    size_t y1 = std::min(rowsToDo, y0 + std::max((size_t) 1, samples / rowsamples));
+    size_t nthreads = countThreads(y1 - y0, mode == SMOOTH ? rowsamples * 16 : rowsamples);
+
+    if (mode == EXACT && y0 == 0 && !(region == ImRect(0, 0, image->w, image->h))) {
+        std::vector<std::vector<long>> result(image->c, std::vector<long>(nbins));
+        if (image->blocks->getHistogram(*image, region, min, max, nbins, result)) {
+            std::lock_guard<std::recursive_mutex> _lock(lock);
+            if (generation == this->generation) {
+                values.swap(result);
+                curh = height;
+                loaded = true;
             }
+            return;
         }
     }
 
-    {
+    if (mode == EXACT) {
+        // each thread has its own tables, merged at the end of the block
+        std::vector<std::vector<std::vector<long>>> bins(nthreads,
+                std::vector<std::vector<long>>(image->c, std::vector<long>(nbins + 1)));
+        runThreads(nthreads, y0, y1, [&](size_t t, size_t start, size_t end) {
+            fillBins(*image, minx, maxx, miny + start, miny + end, min, max, nbins, bins[t]);
+        });
+
         std::lock_guard<std::recursive_mutex> _lock(lock);
-        if (oldh != curh) {
+        if (generation != this->generation) {
             // someone called request()
             return;
         }
-        if (mode == EXACT) {
-            curh++;
-        } else {
-            curh = region.GetHeight();
+        for (size_t t = 0; t < nthreads; t++) {
+            for (size_t d = 0; d < image->c; d++) {
+                for (int b = 0; b < nbins; b++) {
+                    values[d][b] += bins[t][d][b];
+                }
+            }
         }
+    } else if (mode == SMOOTH) {
+        std::vector<std::vector<std::vector<double>>> partial(nthreads,
+                std::vector<std::vector<double>>(image->c, std::vector<double>(nbins)));
+        runThreads(nthreads, y0, y1, [&](size_t t, size_t start, size_t end) {
+            fillJumps(*image, minx, maxx, miny + start, miny + end, min, max, nbins, partial[t]);
+        });
 
-        if (curh == region.GetHeight()) {
-            loaded = true;
+        std::lock_guard<std::recursive_mutex> _lock(lock);
+        if (generation != this->generation) {
+            return;
         }
+        // the jumps are the 2nd derivative of the histogram, publish it integrated twice
+        for (size_t d = 0; d < image->c; d++) {
+            for (size_t t = 0; t < nthreads; t++) {
+                for (int b = 0; b < nbins; b++) {
+                    jumps[d][b] += partial[t][d][b];
+                }
+            }
+            std::vector<double> o = jumps[d];
+            imscript::integrate_values(o.data(), nbins);
+            imscript::integrate_values(o.data(), nbins);
+            for (int b = 0; b < nbins; b++) {
+                values[d][b] = o[b];
+            }
+        }
+    }
 
-        values = valuescopy;
+    curh = y1 == rowsToDo ? height : y1;
+    if (curh == height) {
+        loaded = true;
     }
 }
 
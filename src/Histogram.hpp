@@ -3,6 +3,8 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
 
 #include "imgui.h"
 #define IMGUI_DEFINE_MATH_OPERATORS
@@ -15,8 +17,10 @@ struct Colormap;
 
 class Histogram : public Progressable {
 private:
-    bool loaded;
+    std::atomic<bool> loaded;
     mutable std::recursive_mutex lock;
+    // incremented by request() so that progress() drops its results if it was working on an old request
+    uint64_t generation;
 public:
     enum Mode {
         SMOOTH,
@@ -24,13 +28,16 @@ public:
     } mode;
     float min, max;
     std::vector<std::vector<long>> values;
+    // 2nd derivative of the smooth histogram, accumulated band of rows by band of rows
+    std::vector<std::vector<double>> jumps;
     std::weak_ptr<Image> image;
-    size_t curh;
+    // rows of the region already binned, readable without the lock
+    std::atomic<size_t> curh;
     const int nbins;
     ImRect region;
 
 public:
-    Histogram() : loaded(true), image(std::weak_ptr<Image>()), curh(0), nbins(256), region() {}
+    Histogram() : loaded(true), generation(0), image(std::weak_ptr<Image>()), curh(0), nbins(256), region() {}
 
     void request(std::shared_ptr<Image> image, Mode mode, ImRect region=ImRect(0,0,0,0));
 
@@ -2,6 +2,12 @@
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <deque>
+#include <unordered_map>
 
 extern "C" {
 #include "iio.h"
@@ -9,32 +15,297 @@ extern "C" {
 
 #include "Image.hpp"
 #include "Histogram.hpp"
+#include "Pyramid.hpp"
+#include "BlockStats.hpp"
+#include "Progressable.hpp"
+#include "globals.hpp"
+#include "parallel.hpp"
+
+size_t getSampleSize(SampleType type)
+{
+    switch (type) {
+        case SAMPLE_UINT8:
+            return sizeof(uint8_t);
+        case SAMPLE_UINT16:
+            return sizeof(uint16_t);
+        case SAMPLE_FLOAT32:
+        default:
+            return sizeof(float);
+    }
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// partial statistics of a chunk, sums and counts are per band
+struct Accumulator {
+    std::vector<float> min, max;
+    std::vector<double> sum;
+    std::vector<size_t> count;
+    size_t nans, infs;
+
+    Accumulator(size_t c)
+        : min(c, std::numeric_limits<float>::max()), max(c, std::numeric_limits<float>::lowest()),
+          sum(c, 0.), count(c, 0), nans(0), infs(0) {
+    }
+
+    void merge(const Accumulator& o) {
+        for (size_t d = 0; d < min.size(); d++) {
+            min[d] = std::min(min[d], o.min[d]);
+            max[d] = std::max(max[d], o.max[d]);
+            sum[d] += o.sum[d];
+            count[d] += o.count[d];
+        }
+        nans += o.nans;
+        infs += o.infs;
+    }
+};
+
+// integer samples are always finite
+template <typename T>
+static void accumulate(const T* data, size_t npixels, size_t c, Accumulator& acc)
+{
+    for (size_t d = 0; d < c; d++) {
+        T lo = std::numeric_limits<T>::max();
+        T hi = std::numeric_limits<T>::lowest();
+        uint64_t sum = 0;
+        for (size_t i = 0; i < npixels; i++) {
+            T v = data[i*c+d];
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            sum += v;
+        }
+        if (npixels) {
+            acc.min[d] = std::min(acc.min[d], (float) lo);
+            acc.max[d] = std::max(acc.max[d], (float) hi);
+        }
+        acc.sum[d] += sum;
+        acc.count[d] += npixels;
+    }
+}
+
+#ifdef __SSE2__
+// K registers hold a whole number of pixels, so lane l of register k always holds the band (4k+l)%c
+// returns the number of samples processed
+template <int K>
+static size_t accumulateSSE(const float* data, size_t n, size_t c, Accumulator& acc)
+{
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 highest = _mm_set1_ps(std::numeric_limits<float>::max());
+    const __m128 lowest = _mm_set1_ps(std::numeric_limits<float>::lowest());
+    const size_t step = 4 * K;
+    __m128 vmin[K], vmax[K];
+    __m128i vcount[K], vnans[K];
+    for (int k = 0; k < K; k++) {
+        vmin[k] = highest;
+        vmax[k] = lowest;
+        vcount[k] = _mm_setzero_si128();
+        vnans[k] = _mm_setzero_si128();
+    }
+    double sums[4*K] = {0};
+    // float sums are flushed to doubles regularly to keep their precision
+    const size_t block = step << 10;
+    size_t i = 0;
+    for (; i + step <= n;) {
+        __m128 vsum[K];
+        for (int k = 0; k < K; k++) {
+            vsum[k] = _mm_setzero_ps();
+        }
+        size_t end = std::min(n - n % step, i + block);
+        for (; i < end; i += step) {
+            for (int k = 0; k < K; k++) {
+                __m128 v = _mm_loadu_ps(data + i + 4 * k);
+                // false for nans and infinities
+                __m128 finite = _mm_cmplt_ps(_mm_and_ps(v, absmask), inf);
+                vmin[k] = _mm_min_ps(vmin[k], _mm_or_ps(_mm_and_ps(finite, v), _mm_andnot_ps(finite, highest)));
+                vmax[k] = _mm_max_ps(vmax[k], _mm_or_ps(_mm_and_ps(finite, v), _mm_andnot_ps(finite, lowest)));
+                vsum[k] = _mm_add_ps(vsum[k], _mm_and_ps(finite, v));
+                vcount[k] = _mm_sub_epi32(vcount[k], _mm_castps_si128(finite));
+                vnans[k] = _mm_sub_epi32(vnans[k], _mm_castps_si128(_mm_cmpunord_ps(v, v)));
+            }
+        }
+        for (int k = 0; k < K; k++) {
+            float s[4];
+            _mm_storeu_ps(s, vsum[k]);
+            for (int l = 0; l < 4; l++) {
+                sums[4*k+l] += s[l];
+            }
+        }
+    }
+    for (int k = 0; k < K; k++) {
+        float mins[4], maxs[4];
+        int32_t counts[4], nans[4];
+        _mm_storeu_ps(mins, vmin[k]);
+        _mm_storeu_ps(maxs, vmax[k]);
+        _mm_storeu_si128((__m128i*) counts, vcount[k]);
+        _mm_storeu_si128((__m128i*) nans, vnans[k]);
+        for (int l = 0; l < 4; l++) {
+            size_t d = (4 * k + l) % c;
+            acc.min[d] = std::min(acc.min[d], mins[l]);
+            acc.max[d] = std::max(acc.max[d], maxs[l]);
+            acc.sum[d] += sums[4*k+l];
+            acc.count[d] += counts[l];
+            acc.nans += nans[l];
+            acc.infs += i / step - counts[l] - nans[l];
+        }
+    }
+    return i;
+}
+#endif
+
+template <>
+void accumulate(const float* data, size_t npixels, size_t c, Accumulator& acc)
+{
+    size_t n = npixels * c;
+    size_t i = 0;
+#ifdef __SSE2__
+    // 1, 2 and 4 bands fit in one register, 3 bands (RGB) in three, 8 in two...
+    size_t registers = 1;
+    while ((4 * registers) % c)
+        registers++;
+    switch (registers) {
+        case 1: i = accumulateSSE<1>(data, n, c, acc); break;
+        case 2: i = accumulateSSE<2>(data, n, c, acc); break;
+        case 3: i = accumulateSSE<3>(data, n, c, acc); break;
+        case 4: i = accumulateSSE<4>(data, n, c, acc); break;
+    }
+#endif
+    for (; i < n; i++) {
+        float v = data[i];
+        size_t d = i % c;
+        if (std::isfinite(v)) {
+            acc.min[d] = std::min(acc.min[d], v);
+            acc.max[d] = std::max(acc.max[d], v);
+            acc.sum[d] += v;
+            acc.count[d]++;
+        } else if (std::isnan(v)) {
+            acc.nans++;
+        } else {
+            acc.infs++;
+        }
+    }
+}
+
+static void setStats(ImageStats& stats, const Accumulator& acc)
+{
+    size_t c = acc.min.size();
+    stats.bandmin = acc.min;
+    stats.bandmax = acc.max;
+    stats.bandmean.resize(c);
+    stats.min = std::numeric_limits<float>::max();
+    stats.max = std::numeric_limits<float>::lowest();
+    for (size_t d = 0; d < c; d++) {
+        stats.min = std::min(stats.min, acc.min[d]);
+        stats.max = std::max(stats.max, acc.max[d]);
+        stats.bandmean[d] = acc.count[d] ? acc.sum[d] / acc.count[d] : 0.;
+    }
+    stats.nans = acc.nans;
+    stats.infs = acc.infs;
+}
+
+// chunks smaller than this are not worth a thread
+#define STATS_MIN_CHUNK (1 << 20)
+
+template <typename T>
+static void computeStats(const T* data, size_t npixels, size_t c, ImageStats& stats)
+{
+    size_t nchunks = parallel_chunks(npixels, STATS_MIN_CHUNK / std::max(c, (size_t) 1));
+    std::vector<Accumulator> accs(nchunks, Accumulator(c));
+    parallel_for(npixels, nchunks, [&](size_t i, size_t start, size_t end) {
+        accumulate(data + start * c, end - start, c, accs[i]);
+    });
+    for (size_t i = 1; i < nchunks; i++) {
+        accs[0].merge(accs[i]);
+    }
+    setStats(stats, accs[0]);
+}
 
 Image::Image(float* pixels, size_t w, size_t h, size_t c)
-    : pixels(pixels), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>())
-{
-    static int id = 0;
-    id++;
-    ID = "Image " + std::to_string(id);
-
-    min = std::numeric_limits<float>::max();
-    max = std::numeric_limits<float>::lowest();
-    for (size_t i = 0; i < w*h*c; i++) {
-        float v = pixels[i];
-        min = std::min(min, v);
-        max = std::max(max, v);
-    }
-    if (!std::isfinite(min) || !std::isfinite(max)) {
-        min = std::numeric_limits<float>::max();
-        max = std::numeric_limits<float>::lowest();
-        for (size_t i = 0; i < w*h*c; i++) {
-            float v = pixels[i];
-            if (std::isfinite(v)) {
-                min = std::min(min, v);
-                max = std::max(max, v);
+    : Image(pixels, w, h, c, SAMPLE_FLOAT32)
+{
+}
+
+static std::string makeID()
+{
+    // images are created by the loading threads
+    static std::atomic<int> id(0);
+    return "Image " + std::to_string(++id);
+}
+
+Image::Image(void* pixels, size_t w, size_t h, size_t c, SampleType type)
+    : pixels(pixels), type(type), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>()),
+      pyramid(std::make_shared<Pyramid>()), blocks(std::make_shared<BlockStats>())
+{
+    ID = makeID();
+
+    switch (type) {
+        case SAMPLE_UINT8:
+            computeStats((const uint8_t*) pixels, w*h, c, stats);
+            break;
+        case SAMPLE_UINT16:
+            computeStats((const uint16_t*) pixels, w*h, c, stats);
+            break;
+        case SAMPLE_FLOAT32:
+            computeStats((const float*) pixels, w*h, c, stats);
+            break;
+    }
+    min = stats.min;
+    max = stats.max;
+    size = ImVec2(w, h);
+}
+
+Image::Image(std::shared_ptr<void> owner, void* pixels, size_t w, size_t h, size_t c, SampleType type)
+    : Image(pixels, w, h, c, type)
+{
+    this->owner = owner;
+}
+
+Image::Image(std::shared_ptr<TileSource> tiles, size_t w, size_t h, size_t c, SampleType type)
+    : pixels(nullptr), type(type), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>()),
+      pyramid(std::make_shared<Pyramid>()), blocks(std::make_shared<BlockStats>())
+{
+    ID = makeID();
+    this->tiles = tiles;
+
+    // the statistics are estimated on a few tiles spread over the image
+    size_t ntx = (w + tiles->tilew - 1) / tiles->tilew;
+    size_t nty = (h + tiles->tileh - 1) / tiles->tileh;
+    Accumulator acc(c);
+    for (size_t j = 0; j < 3; j++) {
+        for (size_t i = 0; i < 3; i++) {
+            std::shared_ptr<Image> tile = getTile((ntx - 1) * i / 2, (nty - 1) * j / 2);
+            if (!tile)
+                continue;
+            Accumulator tileacc(c);
+            size_t npixels = tile->w * tile->h;
+            tileacc.min = tile->stats.bandmin;
+            tileacc.max = tile->stats.bandmax;
+            for (size_t d = 0; d < c; d++) {
+                tileacc.sum[d] = tile->stats.bandmean[d] * npixels;
+                tileacc.count[d] = npixels;
             }
+            acc.merge(tileacc);
         }
     }
+    setStats(stats, acc);
+    min = stats.min;
+    max = stats.max;
+    if (min > max) {
+        min = 0;
+        max = 1;
+    }
+    size = ImVec2(w, h);
+}
+
+Image::Image(std::shared_ptr<TileSource> tiles, size_t w, size_t h, const Image& full)
+    : pixels(nullptr), type(full.type), w(w), h(h), c(full.c), min(full.min), max(full.max),
+      stats(full.stats), lastUsed(0), histogram(std::make_shared<Histogram>()),
+      pyramid(std::make_shared<Pyramid>()), blocks(std::make_shared<BlockStats>())
+{
+    ID = makeID();
+    this->tiles = tiles;
     size = ImVec2(w, h);
 }
 
@@ -43,7 +314,223 @@ Image::Image(float* pixels, size_t w, size_t h, size_t c)
 Image::~Image()
 {
     LOG("free image");
-    free(pixels);
+    if (!owner) {
+        free(pixels);
+    }
+}
+
+size_t Image::getSizeInBytes() const
+{
+    // the tiles are accounted for in their own cache entries
+    if (tiles)
+        return 0;
+    return w * h * c * getSampleSize(type);
+}
+
+template <typename T>
+static void copySamples(const T* data, size_t n, size_t stride, float* values)
+{
+    for (size_t i = 0; i < n; i++) {
+        values[i] = data[i*stride];
+    }
+}
+
+// gather the samples run by run, each run staying on one row of one tile
+static void getTiledSamples(const Image& image, size_t offset, size_t n, size_t stride, float* values)
+{
+    size_t tw = image.tiles->tilew;
+    size_t th = image.tiles->tileh;
+    std::shared_ptr<Image> tile;
+    size_t curtx = -1;
+    size_t curty = -1;
+    size_t i = 0;
+    while (i < n) {
+        size_t index = offset + i * stride;
+        size_t y = index / (image.w * image.c);
+        size_t x = (index / image.c) % image.w;
+        size_t b = index % image.c;
+        size_t tx = x / tw;
+        size_t ty = y / th;
+        if (tx != curtx || ty != curty) {
+            tile = image.getTile(tx, ty);
+            curtx = tx;
+            curty = ty;
+        }
+
+        size_t rowend = (y * image.w + std::min((tx + 1) * tw, image.w)) * image.c;
+        size_t count = std::min(n - i, (rowend - index + stride - 1) / stride);
+        if (tile) {
+            size_t tileoffset = ((y - ty * th) * tile->w + (x - tx * tw)) * image.c + b;
+            tile->getSamples(tileoffset, count, stride, values + i);
+        } else {
+            std::fill(values + i, values + i + count, 0.f);
+        }
+        i += count;
+    }
+}
+
+void Image::getSamples(size_t offset, size_t n, size_t stride, float* values) const
+{
+    if (tiles) {
+        getTiledSamples(*this, offset, n, stride, values);
+        return;
+    }
+
+    switch (type) {
+        case SAMPLE_UINT8:
+            copySamples((const uint8_t*) pixels + offset, n, stride, values);
+            break;
+        case SAMPLE_UINT16:
+            copySamples((const uint16_t*) pixels + offset, n, stride, values);
+            break;
+        case SAMPLE_FLOAT32:
+            copySamples((const float*) pixels + offset, n, stride, values);
+            break;
+    }
+}
+
+std::shared_ptr<const float> Image::getFloatPixels() const
+{
+    if (type == SAMPLE_FLOAT32 && !tiles) {
+        return std::shared_ptr<const float>((const float*) pixels, [](const float*) {});
+    }
+    float* values = (float*) malloc(sizeof(float) * w * h * c);
+    getSamples(0, w * h * c, 1, values);
+    return std::shared_ptr<const float>(values, [](const float* v) { free((void*) v); });
+}
+
+static std::string getTileKey(const std::string& ID, size_t tx, size_t ty)
+{
+    return ID + " tile " + std::to_string(tx) + "," + std::to_string(ty);
+}
+
+std::shared_ptr<Image> getCachedTile(const std::string& ID, TileSource& tiles, size_t tx, size_t ty)
+{
+    std::string key = getTileKey(ID, tx, ty);
+    std::shared_ptr<Image> tile = ImageCache::get(key);
+    if (!tile) {
+        tile = tiles.readTile(tx, ty);
+        if (tile) {
+            ImageCache::store(key, tile);
+        }
+    }
+    return tile;
+}
+
+std::shared_ptr<Image> Image::getTile(size_t tx, size_t ty) const
+{
+    return getCachedTile(ID, *tiles, tx, ty);
+}
+
+// requests older than the last ones are dropped, the view has moved since then
+#define MAX_TILE_REQUESTS 256
+
+class TileRequest : public Progressable {
+    std::shared_ptr<TileSource> tiles;
+    size_t tx, ty;
+    std::atomic<bool> loaded;
+
+public:
+    std::string key;
+
+    TileRequest(const std::shared_ptr<TileSource>& tiles, size_t tx, size_t ty, const std::string& key)
+        : tiles(tiles), tx(tx), ty(ty), loaded(false), key(key) {
+    }
+
+    float getProgressPercentage() const {
+        return loaded ? 1.f : 0.f;
+    }
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void progress();
+};
+
+namespace TileRequests {
+
+    static std::mutex lock;
+    // requests by key, until they are decoded
+    static std::unordered_map<std::string, std::shared_ptr<TileRequest>> requests;
+    // requests not taken by a loading thread yet, the most recent last
+    static std::deque<std::shared_ptr<TileRequest>> queue;
+
+    static void add(const std::shared_ptr<TileSource>& tiles, size_t tx, size_t ty, const std::string& key)
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        if (requests.count(key))
+            return;
+        auto request = std::make_shared<TileRequest>(tiles, tx, ty, key);
+        requests[key] = request;
+        queue.push_back(request);
+        if (queue.size() > MAX_TILE_REQUESTS) {
+            requests.erase(queue.front()->key);
+            queue.pop_front();
+        }
+    }
+
+    static void remove(const std::string& key)
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        requests.erase(key);
+    }
+
+    bool pending()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        return !queue.empty();
+    }
+
+    std::shared_ptr<Progressable> getNext()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        if (queue.empty())
+            return nullptr;
+        std::shared_ptr<TileRequest> request = queue.back();
+        queue.pop_back();
+        return request;
+    }
+
+}
+
+void TileRequest::progress()
+{
+    std::shared_ptr<Image> tile = tiles->readTile(tx, ty);
+    if (tile) {
+        ImageCache::store(key, tile);
+    }
+    TileRequests::remove(key);
+    loaded = true;
+    // the display waits for it
+    gActive = std::max(gActive, 2);
+}
+
+bool Image::requestTiles(size_t x0, size_t y0, size_t x1, size_t y1) const
+{
+    bool ready = true;
+    for (size_t ty = y0 / tiles->tileh; ty * tiles->tileh < std::min(y1, h); ty++) {
+        for (size_t tx = x0 / tiles->tilew; tx * tiles->tilew < std::min(x1, w); tx++) {
+            std::string key = getTileKey(ID, tx, ty);
+            if (!ImageCache::has(key)) {
+                TileRequests::add(tiles, tx, ty, key);
+                ready = false;
+            }
+        }
+    }
+    return ready;
+}
+
+void Image::addUser(const std::string& key)
+{
+    std::lock_guard<std::mutex> _lock(usersLock);
+    usedBy.insert(key);
+}
+
+std::set<std::string> Image::getUsers() const
+{
+    std::lock_guard<std::mutex> _lock(usersLock);
+    return usedBy;
 }
 
 void Image::getPixelValueAt(size_t x, size_t y, float* values, size_t d) const
@@ -51,12 +538,9 @@ void Image::getPixelValueAt(size_t x, size_t y, float* values, size_t d) const
     if (x >= w || y >= h)
         return;
 
-    const float* data = (float*) pixels + (w * y + x)*c;
-    const float* end = (float*) pixels + (w * h)*c;
-    for (size_t i = 0; i < d; i++) {
-        if (data + i >= end) break;
-        values[i] = data[i];
-    }
+    size_t offset = (w * y + x)*c;
+    size_t end = (w * h)*c;
+    getSamples(offset, std::min(d, end - offset), 1, values);
 }
 
 std::array<bool,3> Image::getPixelValueAtBands(size_t x, size_t y, BandIndices bands, float* values) const
@@ -65,11 +549,11 @@ std::array<bool,3> Image::getPixelValueAtBands(size_t x, size_t y, BandIndices b
     if (x >= w || y >= h)
         return valids;
 
-    const float* data = (float*) pixels + (w * y + x)*c;
+    size_t offset = (w * y + x)*c;
     for (size_t i = 0; i < 3; i++) {
         int b = bands[i];
         if (b >= c) continue;
-        values[i] = data[b];
+        getSamples(offset + b, 1, 1, &values[i]);
         valids[i] = true;
     }
     return valids;
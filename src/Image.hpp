@@ -4,41 +4,138 @@
 #include <memory>
 #include <string>
 #include <array>
+#include <vector>
+#include <cstdint>
+#include <mutex>
 
 #include "imgui.h"
 
-#if 0
-struct ImageTile {
-    unsigned id;
-    int x, y;
-    size_t w, h, c;
-    size_t scale;
-    std::vector<float> pixels;
-};
-#endif
-
 typedef std::array<size_t,3> BandIndices;
 #define BANDS_DEFAULT (BandIndices{0,1,2})
 
 class Histogram;
+class Pyramid;
+class BlockStats;
+
+// storage type of the samples, the values are kept as read (no normalization)
+enum SampleType {
+    SAMPLE_UINT8,
+    SAMPLE_UINT16,
+    SAMPLE_FLOAT32,
+};
+
+size_t getSampleSize(SampleType type);
+
+struct Image;
+
+// statistics of the samples, computed once when the image is created
+// the non-finite samples are only counted
+struct ImageStats {
+    float min, max;
+    std::vector<float> bandmin, bandmax;
+    std::vector<double> bandmean;
+    size_t nans, infs;
+};
+
+// decodes rectangular parts of an image on demand, for images too big to be read at once
+struct TileSource {
+    size_t tilew, tileh;
+
+    TileSource(size_t tilew, size_t tileh) : tilew(tilew), tileh(tileh) {
+    }
+
+    virtual ~TileSource() {
+    }
+
+    // returns the tile (tx, ty) cropped to the image borders, or nullptr on error
+    // can be called from any thread
+    virtual std::shared_ptr<Image> readTile(size_t tx, size_t ty) = 0;
+
+    // the image reduced 2^level times (sizes rounded up at each level), for formats
+    // that store overviews, nullptr if the levels have to be computed from the tiles
+    virtual std::shared_ptr<TileSource> getLevel(int /*level*/) {
+        return nullptr;
+    }
+
+    // whether the tiles are computed (e.g. by an edit) rather than decoded, in which case
+    // computeWhole() evaluates the whole image at once, faster than tile by tile
+    virtual bool canComputeWhole() const {
+        return false;
+    }
+
+    // the whole image, nullptr on error
+    virtual std::shared_ptr<Image> computeWhole() {
+        return nullptr;
+    }
+};
 
 struct Image {
     std::string ID;
-    float* pixels;
+    void* pixels;
+    SampleType type;
     size_t w, h, c;
     ImVec2 size;
     float min;
     float max;
+    ImageStats stats;
     uint64_t lastUsed;
     std::shared_ptr<Histogram> histogram;
+    std::shared_ptr<Pyramid> pyramid;
+    std::shared_ptr<BlockStats> blocks;
 
+    // keys of the edits computed from this image, evicted along with it
+    void addUser(const std::string& key);
+    std::set<std::string> getUsers() const;
+    // when set, the pixels belong to this object (e.g. a file mapping) and are not freed
+    std::shared_ptr<void> owner;
+    // when set, pixels is null and the samples are decoded tile by tile when accessed
+    std::shared_ptr<TileSource> tiles;
+
+private:
+    // several edits can use the image from different loading threads
+    mutable std::mutex usersLock;
     std::set<std::string> usedBy;
 
+public:
     Image(float* pixels, size_t w, size_t h, size_t c);
+    Image(void* pixels, size_t w, size_t h, size_t c, SampleType type);
+    Image(std::shared_ptr<void> owner, void* pixels, size_t w, size_t h, size_t c, SampleType type);
+    Image(std::shared_ptr<TileSource> tiles, size_t w, size_t h, size_t c, SampleType type);
+    // a tiled reduction of 'full' (a level of its pyramid), which reuses its statistics
+    Image(std::shared_ptr<TileSource> tiles, size_t w, size_t h, const Image& full);
     ~Image();
 
+    size_t getSizeInBytes() const;
+
+    // copy n samples, starting from the sample 'offset' and every 'stride' samples, as floats
+    void getSamples(size_t offset, size_t n, size_t stride, float* values) const;
+    // the whole buffer as floats, only converted if needed
+    // the pointer is valid as long as both the image and the returned shared_ptr are alive
+    std::shared_ptr<const float> getFloatPixels() const;
+
+    // the tile (tx, ty) of a tiled image, taken from the cache or decoded
+    std::shared_ptr<Image> getTile(size_t tx, size_t ty) const;
+    // whether the tiles covering [x0,x1)x[y0,y1) are all in the cache
+    // the missing ones are queued for the loading threads (see TileRequests) instead of being decoded
+    bool requestTiles(size_t x0, size_t y0, size_t x1, size_t y1) const;
+
     void getPixelValueAt(size_t x, size_t y, float* values, size_t d) const;
     std::array<bool,3> getPixelValueAtBands(size_t x, size_t y, BandIndices bands, float* values) const;
 
 };
 
+// the tile (tx, ty) of the tiled image 'ID', taken from the cache or decoded by 'tiles'
+std::shared_ptr<Image> getCachedTile(const std::string& ID, TileSource& tiles, size_t tx, size_t ty);
+
+class Progressable;
+
+// tiles asked by the display, decoded by the loading threads so that the UI never waits for them
+namespace TileRequests {
+
+    // whether some tiles are waiting for a loading thread
+    bool pending();
+
+    // next tile to decode, from the loading threads
+    std::shared_ptr<Progressable> getNext();
+
+}
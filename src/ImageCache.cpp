@@ -1,6 +1,7 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <list>
 #include <mutex>
 #include <cstdlib>
 
@@ -12,11 +13,29 @@
 #include "ImageProvider.hpp"
 
 namespace ImageCache {
-    static std::unordered_map<std::string, std::shared_ptr<Image>> cache;
+    // entries are kept in a recency list (most recently used first)
+    // so that the eviction only has to look at the tail
+    struct Entry {
+        std::shared_ptr<Image> image;
+        std::list<std::string>::iterator lru;
+    };
+    static std::unordered_map<std::string, Entry> cache;
+    static std::list<std::string> lru;
     static std::mutex lock;
     static size_t cacheSize = 0;
     static bool cacheFull = false;
 
+    static size_t sizeOf(const std::shared_ptr<Image>& image)
+    {
+        return image->getSizeInBytes();
+    }
+
+    static void touch(Entry& entry)
+    {
+        letTimeFlow(&entry.image->lastUsed);
+        lru.splice(lru.begin(), lru, entry.lru);
+    }
+
     bool has(const std::string& key)
     {
         std::lock_guard<std::mutex> _lock(lock);
@@ -26,16 +45,20 @@ namespace ImageCache {
     std::shared_ptr<Image> get(const std::string& key)
     {
         std::lock_guard<std::mutex> _lock(lock);
-        std::shared_ptr<Image> image = cache[key];
-        return image;
+        auto i = cache.find(key);
+        if (i == cache.end()) {
+            return nullptr;
+        }
+        touch(i->second);
+        return i->second.image;
     }
 
     std::shared_ptr<Image> getById(const std::string& id)
     {
         std::lock_guard<std::mutex> _lock(lock);
-        for (auto c : cache) {
-            if (c.second->ID == id) {
-                return c.second;
+        for (auto& c : cache) {
+            if (c.second.image->ID == id) {
+                return c.second.image;
             }
         }
         return nullptr;
@@ -43,32 +66,20 @@ namespace ImageCache {
 
     static bool hasSpaceFor(const std::shared_ptr<Image>& image)
     {
-        size_t need = image->w * image->h * image->c * sizeof(float);
+        size_t need = sizeOf(image);
         size_t limit = gCacheLimitMB*1000000;
         return cacheSize + need < limit;
     }
 
     static bool makeRoomFor(const std::shared_ptr<Image>& image)
     {
-        size_t need = image->w * image->h * image->c * sizeof(float);
+        size_t need = sizeOf(image);
         size_t limit = gCacheLimitMB*1000000;
 
         if (need > limit) return false;
-        while (cacheSize + need > limit) {
-            std::string worst;
-
-            // FIXME: slow, use a priority queue to sort old images upto a given space limit
-            double last = -1;
-            for (auto it = cache.begin(); it != cache.end(); it++) {
-                std::shared_ptr<Image> img = it->second;
-                uint64_t t = img->lastUsed;
-                double imgtime = letTimeFlow(&t);
-                if (imgtime > last) {
-                    worst = it->first;
-                    last = imgtime;
-                }
-            }
-
+        while (cacheSize + need > limit && !lru.empty()) {
+            // the least recently used image is at the back of the list
+            std::string worst = lru.back();
             remove_rec(worst);
         }
         return true;
@@ -83,9 +94,10 @@ namespace ImageCache {
         // check whether we already have it
         auto i = cache.find(key);
         if (i != cache.end()) {
+            // this happens when two CacheImageProviders share the same provider
+            // and both finish it on different loading threads
             LOG2("store image " << key << " but we already have it...");
-            //puts(0);
-            exit(1);
+            touch(i->second);
             return;
         }
         if (!hasSpaceFor(image)) {
@@ -96,8 +108,9 @@ namespace ImageCache {
         } else {
             cacheFull = false;
         }
-        cache[key] = image;
-        cacheSize += image->w * image->h * image->c * sizeof(float);
+        lru.push_front(key);
+        cache[key] = Entry{image, lru.begin()};
+        cacheSize += sizeOf(image);
         LOG2("store image " << key << " " << image);
     }
 
@@ -105,11 +118,12 @@ namespace ImageCache {
     {
         auto i = cache.find(key);
         if (i != cache.end()) {
-            std::shared_ptr<Image> image = i->second;
+            std::shared_ptr<Image> image = i->second.image;
             LOG2("remove image " << key << " " << image);
+            lru.erase(i->second.lru);
             cache.erase(i);
-            cacheSize -= image->w * image->h * image->c * sizeof(float);
-            for (auto k : image->usedBy) {
+            cacheSize -= sizeOf(image);
+            for (auto k : image->getUsers()) {
                 LOG2("try remove " << k);
                 remove_rec(k);
             }
@@ -134,6 +148,7 @@ namespace ImageCache {
     {
         std::lock_guard<std::mutex> _lock(lock);
         cache.clear();
+        lru.clear();
         cacheSize = 0;
         cacheFull = false;
     }
@@ -1,4 +1,6 @@
 #include <sys/stat.h>
+#include <cstring>
+#include <atomic>
 #include "ImageProvider.hpp"
 #include "Sequence.hpp"
 #include "globals.hpp"
@@ -10,6 +12,12 @@
 #include <gdal.h>
 #endif
 
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static std::shared_ptr<ImageProvider> selectProvider(const std::string& filename)
 {
     struct stat st;
@@ -42,8 +50,9 @@ static std::shared_ptr<ImageProvider> selectProvider(const std::string& filename
         return std::make_shared<PNGFileImageProvider>(filename);
     } else if ((tag[0]=='M' && tag[1]=='M') || (tag[0]=='I' && tag[1]=='I')) {
         // check whether the file can be opened with libraw or not
-        if (RAWFileImageProvider::canOpen(filename)) {
-            return std::make_shared<RAWFileImageProvider>(filename);
+        std::shared_ptr<RAWFileImageProvider> raw = RAWFileImageProvider::open(filename);
+        if (raw) {
+            return raw;
         } else {
 #ifndef USE_GDAL // in case we have gdal, just use it, it's better than our loader anyway
             return std::make_shared<TIFFFileImageProvider>(filename);
@@ -89,70 +98,171 @@ std::shared_ptr<ImageProvider> SingleImageImageCollection::getImageProvider(int
 std::shared_ptr<ImageProvider> EditedImageCollection::getImageProvider(int index) const
 {
     std::string key = getKey(index);
-    auto provider = [&]() {
+    // an input used several times by the edit gets a single provider
+    auto getProviders = [&](int index) {
         std::vector<std::shared_ptr<ImageProvider>> providers;
-        for (auto c : collections) {
+        for (size_t i = 0; i < collections.size(); i++) {
+            ImageCollection* c = collections[i];
             int iindex = std::min(index, c->getLength() - 1);
-            providers.push_back(c->getImageProvider(iindex));
+            std::shared_ptr<ImageProvider> provider;
+            for (size_t j = 0; j < i && !provider; j++) {
+                if (collections[j] == c)
+                    provider = providers[j];
+            }
+            providers.push_back(provider ? provider : c->getImageProvider(iindex));
+        }
+        return providers;
+    };
+    auto provider = [&]() {
+        // octave edits groups of gOctaveBatch frames at once, the frames of a group share the work
+        if (edittype == OCTAVE && downscale == 1 && gOctaveBatch > 1) {
+            int first = index / gOctaveBatch * gOctaveBatch;
+            int end = std::min(first + gOctaveBatch, getLength());
+            std::string batchkey = getKey(first) + " batch:" + std::to_string(end - first);
+            auto batch = EditBatch::get(batchkey, [&]() {
+                std::vector<std::vector<std::shared_ptr<ImageProvider>>> frames;
+                std::vector<std::string> keys;
+                for (int i = first; i < end; i++) {
+                    frames.push_back(getProviders(i));
+                    keys.push_back(getKey(i));
+                }
+                return std::make_shared<EditBatch>(edittype, editprog, frames, keys);
+            });
+            return std::make_shared<EditedImageProvider>(edittype, editprog, batch, key);
         }
-        return std::make_shared<EditedImageProvider>(edittype, editprog, providers, key);
+        return std::make_shared<EditedImageProvider>(edittype, editprog, getProviders(index), key, downscale);
     };
     return std::make_shared<CacheImageProvider>(key, provider);
 }
 
+// read-only mapping of a whole file, kept alive by the collection and by the images viewing it
+struct MappedFile {
+    void* data;
+    uint64_t size;
+
+    MappedFile(void* data, uint64_t size) : data(data), size(size) {
+    }
+
+    ~MappedFile() {
+#ifndef WINDOWS
+        munmap(data, size);
+#endif
+    }
+
+    // in watch mode the file can be truncated and rewritten while it is mapped, and reading
+    // the mapping would then raise SIGBUS, so the frames are read with stdio instead
+    static std::shared_ptr<MappedFile> open(const std::string& filename) {
+#ifndef WINDOWS
+        if (watcher_is_enabled())
+            return nullptr;
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return nullptr;
+        return std::make_shared<MappedFile>(data, st.st_size);
+#else
+        return nullptr;
+#endif
+    }
+};
+
+// a frame can be handed over without copy if it is fully mapped and correctly aligned
+static bool canViewFrame(const std::shared_ptr<MappedFile>& mapping, uint64_t offset,
+                         size_t size, SampleType type)
+{
+    return mapping
+        && offset + size <= mapping->size
+        && ((uintptr_t) mapping->data + offset) % getSampleSize(type) == 0;
+}
+
+// copy a frame into a malloc'ed buffer, from the mapping if there is one
+static void* readFrame(const std::string& filename, const std::shared_ptr<MappedFile>& mapping,
+                       uint64_t offset, size_t size)
+{
+    if (mapping) {
+        if (offset + size > mapping->size)
+            return nullptr;
+        void* data = malloc(size);
+        memcpy(data, (uint8_t*) mapping->data + offset, size);
+        return data;
+    }
+
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return nullptr;
+#ifdef WINDOWS
+    int seek = _fseeki64(file, offset, SEEK_SET);
+#else
+    int seek = fseeko(file, offset, SEEK_SET);
+#endif
+    void* data = malloc(size);
+    if (seek != 0 || fread(data, 1, size, file) != size) {
+        free(data);
+        data = nullptr;
+    }
+    fclose(file);
+    return data;
+}
+
 class VPPVideoImageProvider : public VideoImageProvider {
-    FILE* file;
+    std::shared_ptr<MappedFile> mapping;
     int w, h, d;
-    int curh;
-    float* pixels;
 public:
-    VPPVideoImageProvider(const std::string& filename, int index, int w, int h, int d)
-        : VideoImageProvider(filename, index),
-          file(fopen(filename.c_str(), "r")), w(w), h(h), d(d), curh(0) {
-        fseek(file, 4+3*sizeof(int)+w*h*d*sizeof(float)*index, SEEK_SET);
-        pixels = (float*) malloc(w*h*d*sizeof(float));
+    VPPVideoImageProvider(const std::string& filename, int index, int w, int h, int d,
+                          std::shared_ptr<MappedFile> mapping)
+        : VideoImageProvider(filename, index), mapping(mapping), w(w), h(h), d(d) {
     }
 
     ~VPPVideoImageProvider() {
-        if (pixels)
-            free(pixels);
-        fclose(file);
     }
 
     float getProgressPercentage() const {
-        return (float) curh / h;
+        return 1.f;
     }
 
     void progress() {
-        if (curh < h) {
-            if (!fread(pixels+curh*w*d, sizeof(float), w*d, file)) {
-                onFinish(makeError("error vpp"));
-            }
-            curh++;
+        size_t framesize = (size_t) w * h * d * sizeof(float);
+        uint64_t pos = 4 + 3 * sizeof(int) + (uint64_t) frame * framesize;
+        if (canViewFrame(mapping, pos, framesize, SAMPLE_FLOAT32)) {
+            void* pixels = (uint8_t*) mapping->data + pos;
+            onFinish(std::make_shared<Image>(mapping, pixels, w, h, d, SAMPLE_FLOAT32));
+            return;
+        }
+        float* pixels = (float*) readFrame(filename, mapping, pos, framesize);
+        if (!pixels) {
+            onFinish(makeError("error vpp"));
         } else {
-            auto image = std::make_shared<Image>(pixels, w, h, d);
-            onFinish(image);
-            pixels = nullptr;
+            onFinish(std::make_shared<Image>(pixels, w, h, d));
         }
     }
 };
 
 class VPPVideoImageCollection : public VideoImageCollection {
     size_t length;
-    int error;
     int w, h, d;
+    std::shared_ptr<MappedFile> mapping;
 public:
     VPPVideoImageCollection(const std::string& filename) : VideoImageCollection(filename), length(0) {
-        FILE* file = fopen(filename.c_str(), "r");
+        FILE* file = fopen(filename.c_str(), "rb");
         char tag[4];
-        if (fread(tag, 1, 4, file) == 4
+        struct stat st;
+        if (file && fread(tag, 1, 4, file) == 4
             && fread(&w, sizeof(int), 1, file)
             && fread(&h, sizeof(int), 1, file)
-            && fread(&d, sizeof(int), 1, file)) {
-            fseek(file, 0, SEEK_END);
-            length = (ftell(file)-4-3*sizeof(int)) / (w*h*d*sizeof(float));
+            && fread(&d, sizeof(int), 1, file)
+            && stat(filename.c_str(), &st) == 0) {
+            length = ((uint64_t) st.st_size - 4 - 3 * sizeof(int)) / ((uint64_t) w * h * d * sizeof(float));
+            mapping = MappedFile::open(filename);
         }
-        fclose(file);
+        if (file) fclose(file);
     }
 
     ~VPPVideoImageCollection() {
@@ -164,7 +274,7 @@ public:
 
     std::shared_ptr<ImageProvider> getImageProvider(int index) const {
         auto provider = [&]() {
-            return std::make_shared<VPPVideoImageProvider>(filename, index, w, h, d);
+            return std::make_shared<VPPVideoImageProvider>(filename, index, w, h, d, mapping);
         };
         std::string key = getKey(index);
         return std::make_shared<CacheImageProvider>(key, provider);
@@ -175,14 +285,33 @@ extern "C" {
 #include "npy.h"
 }
 
+// dtypes that Image can store as they are on disk (little-endian host)
+static bool getNpySampleType(const struct npy_info& ni, SampleType& type)
+{
+    std::string desc(ni.desc);
+    if (desc == "<f4" || desc == "=f4" || desc == "<c8" || desc == "=c8") {
+        type = SAMPLE_FLOAT32;
+    } else if (desc == "|u1" || desc == "<u1" || desc == "=u1" || desc == "|b1") {
+        type = SAMPLE_UINT8;
+    } else if (desc == "<u2" || desc == "=u2") {
+        type = SAMPLE_UINT16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 class NumpyVideoImageProvider : public VideoImageProvider {
     int w, h, d;
     size_t length;
     struct npy_info ni;
+    std::shared_ptr<MappedFile> mapping;
 public:
     NumpyVideoImageProvider(const std::string& filename, int index, int w, int h,
-                            int d, size_t length, struct npy_info ni)
-        : VideoImageProvider(filename, index), w(w), h(h), d(d), length(length), ni(ni) {
+                            int d, size_t length, struct npy_info ni,
+                            std::shared_ptr<MappedFile> mapping)
+        : VideoImageProvider(filename, index), w(w), h(h), d(d), length(length), ni(ni),
+          mapping(mapping) {
     }
 
     ~NumpyVideoImageProvider() {
@@ -193,21 +322,28 @@ public:
     }
 
     void progress() {
-        FILE* file = fopen(filename.c_str(), "r");
         // compute frame position and read it
         size_t framesize = npy_type_size(ni.type) * w * h * d;
-        long pos = ni.header_offset + frame * framesize;
-        fseek(file, pos, SEEK_SET);
-        void* data = malloc(framesize);
-        if (fread(data, 1, framesize, file) != framesize) {
+        uint64_t pos = ni.header_offset + (uint64_t) frame * framesize;
+        SampleType type;
+        bool native = getNpySampleType(ni, type);
+        if (native && canViewFrame(mapping, pos, framesize, type)) {
+            void* pixels = (uint8_t*) mapping->data + pos;
+            onFinish(std::make_shared<Image>(mapping, pixels, w, h, d, type));
+            return;
+        }
+
+        void* data = readFrame(filename, mapping, pos, framesize);
+        if (!data) {
             onFinish(makeError("npy: couldn't read frame"));
+        } else if (native) {
+            onFinish(std::make_shared<Image>(data, w, h, d, type));
         } else {
             // convert to float
             float* pixels = npy_convert_to_float(data, w * h * d, ni.type);
             auto image = std::make_shared<Image>(pixels, w, h, d);
             onFinish(image);
         }
-        fclose(file);
     }
 };
 
@@ -215,14 +351,17 @@ class NumpyVideoImageCollection : public VideoImageCollection {
     size_t length;
     int w, h, d;
     struct npy_info ni;
+    // replaced when the file is reloaded, so accessed atomically
+    std::shared_ptr<MappedFile> mapping;
 
     void loadHeader() {
-        FILE* file = fopen(filename.c_str(), "r");
-        if (!npy_read_header(file, &ni)) {
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (!file || !npy_read_header(file, &ni)) {
             fprintf(stderr, "[npy] error while loading header\n");
             //exit(1);
         }
-        fclose(file);
+        if (file) fclose(file);
+        std::atomic_store(&mapping, MappedFile::open(filename));
 
         if (ni.fortran_order) {
             fprintf(stderr, "numpy array '%s' is fortran order, please ask kidanger for support.\n",
@@ -272,7 +411,8 @@ public:
         std::string key = getKey(index);
         std::string filename = this->filename;
         auto provider = [&]() {
-            auto provider = std::make_shared<NumpyVideoImageProvider>(filename, index, w, h, d, length, ni);
+            auto provider = std::make_shared<NumpyVideoImageProvider>(filename, index, w, h, d, length, ni,
+                                                                      std::atomic_load(&mapping));
             watcher_add_file(filename, [key,this](const std::string& fname) {
                 LOG("file changed " << filename);
                 ImageCache::Error::remove(key);
@@ -153,12 +153,19 @@ class EditedImageCollection : public ImageCollection {
     EditType edittype;
     std::string editprog;
     std::vector<ImageCollection*> collections;
+    // the inputs are downscaled by this factor, to preview the edit quickly
+    int downscale;
+    // prefix of the keys, identical for edits that compute the same thing
+    std::string keyprefix;
 
 public:
 
     EditedImageCollection(EditType edittype, const std::string& editprog,
-                          const std::vector<ImageCollection*>& collections)
-            : edittype(edittype), editprog(editprog), collections(collections) {
+                          const std::vector<ImageCollection*>& collections, int downscale=1)
+            : edittype(edittype), editprog(editprog), collections(collections), downscale(downscale) {
+        std::string prog = canonical_edit_program(edittype, editprog);
+        keyprefix = "edit:" + std::to_string(edittype) + "/" + std::to_string(downscale)
+                    + ":" + std::to_string(prog.size()) + ":" + prog;
     }
 
     virtual ~EditedImageCollection() {
@@ -172,10 +179,14 @@ public:
         return collections[0]->getFilename(index);
     }
 
+    // the key is made of the program and of the keys of the inputs actually used,
+    // each prefixed by its length so that different edits cannot collide
     std::string getKey(int index) const {
-        std::string key("edit:" + std::to_string(edittype) + editprog);
-        for (auto c : collections)
-            key += c->getKey(index);
+        std::string key(keyprefix);
+        for (auto c : collections) {
+            std::string ckey = c->getKey(std::min(index, c->getLength() - 1));
+            key += "|" + std::to_string(ckey.size()) + ":" + ckey;
+        }
         return key;
     }
 
@@ -1,4 +1,7 @@
 #include <errno.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 extern "C" {
 #include "iio.h"
@@ -7,6 +10,49 @@ extern "C" {
 #include "Image.hpp"
 #include "editors.hpp"
 #include "ImageProvider.hpp"
+#include "Pyramid.hpp"
+#include "globals.hpp"
+#include "watcher.hpp"
+#include "parallel.hpp"
+
+// images with more pixels than this are decoded tile by tile when the format allows it
+#define TILED_LOADING_MIN_PIXELS (8192*8192)
+
+static std::unordered_map<std::string, std::weak_ptr<ImageProvider>> inFlight;
+static std::mutex inFlightLock;
+
+std::shared_ptr<ImageProvider> CacheImageProvider::getInFlight(const std::string& key,
+                         const std::function<std::shared_ptr<ImageProvider>()>& get)
+{
+    {
+        std::lock_guard<std::mutex> _lock(inFlightLock);
+        auto i = inFlight.find(key);
+        if (i != inFlight.end()) {
+            std::shared_ptr<ImageProvider> provider = i->second.lock();
+            if (provider) {
+                return provider;
+            }
+        }
+    }
+
+    // get() can create other CacheImageProviders (edited collections), so don't hold the lock
+    std::shared_ptr<ImageProvider> provider = get();
+
+    std::lock_guard<std::mutex> _lock(inFlightLock);
+    std::shared_ptr<ImageProvider> other = inFlight[key].lock();
+    if (other) {
+        // someone was faster than us
+        return other;
+    }
+    inFlight[key] = provider;
+    return provider;
+}
+
+void CacheImageProvider::removeInFlight(const std::string& key)
+{
+    std::lock_guard<std::mutex> _lock(inFlightLock);
+    inFlight.erase(key);
+}
 
 static std::shared_ptr<Image> load_from_iio(const std::string& filename)
 {
@@ -32,11 +78,122 @@ void IIOFileImageProvider::progress()
 #ifdef USE_GDAL
 #include <gdal.h>
 #include <gdal_priv.h>
+// datasets of a file for the threads reading it, a GDALDataset can't be read from two threads at once
+// a reader takes one for the time of its read, another one is opened if none is free
+// the tile sources of the levels share them
+struct GDALHandles {
+    std::string filename;
+    std::mutex lock;
+    std::vector<GDALDataset*> datasets;
+
+    GDALHandles(const std::string& filename) : filename(filename) {
+    }
+
+    ~GDALHandles() {
+        for (GDALDataset* g : datasets) {
+            GDALClose(g);
+        }
+    }
+
+    // nullptr if the file can't be opened anymore
+    GDALDataset* acquire() {
+        {
+            std::lock_guard<std::mutex> _lock(lock);
+            if (!datasets.empty()) {
+                GDALDataset* g = datasets.back();
+                datasets.pop_back();
+                return g;
+            }
+        }
+        return (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+    }
+
+    void release(GDALDataset* g) {
+        std::lock_guard<std::mutex> _lock(lock);
+        datasets.push_back(g);
+    }
+};
+
+struct GDALTileSource : TileSource {
+    std::shared_ptr<GDALHandles> handles;
+    int d;
+    int tf;
+    GDALDataType asktype;
+    // size of the raster, size of the level and number of pixels of the raster per pixel of the level
+    size_t rasterw, rasterh;
+    size_t w, h;
+    size_t scale;
+
+    GDALTileSource(std::shared_ptr<GDALHandles> handles, size_t tilew, size_t tileh,
+                   int d, int tf, GDALDataType asktype, size_t rasterw, size_t rasterh,
+                   size_t w, size_t h, size_t scale=1)
+        : TileSource(tilew, tileh), handles(handles), d(d), tf(tf), asktype(asktype),
+          rasterw(rasterw), rasterh(rasterh), w(w), h(h), scale(scale) {
+    }
+
+    std::shared_ptr<Image> readTile(size_t tx, size_t ty) {
+        size_t x = tx * tilew;
+        size_t y = ty * tileh;
+        if (x >= w || y >= h)
+            return nullptr;
+        size_t cw = std::min(tilew, w - x);
+        size_t ch = std::min(tileh, h - y);
+
+        // the window in the raster, GDAL reads it from the overview matching the scale if any
+        size_t rx = x * scale;
+        size_t ry = y * scale;
+        size_t rw = std::min(cw * scale, rasterw - rx);
+        size_t rh = std::min(ch * scale, rasterh - ry);
+
+        GDALDataset* g = handles->acquire();
+        if (!g)
+            return nullptr;
+        float* pixels = (float*) malloc(sizeof(float) * cw * ch * d * tf);
+        CPLErr err = g->RasterIO(GF_Read, rx, ry, rw, rh, pixels, cw, ch, asktype, d, NULL,
+                                 sizeof(float)*d*tf, sizeof(float)*cw*d*tf, sizeof(float)*tf, NULL);
+        handles->release(g);
+        if (err != CE_None) {
+            free(pixels);
+            return nullptr;
+        }
+        return std::make_shared<Image>(pixels, cw, ch, d * tf);
+    }
+
+    std::shared_ptr<TileSource> getLevel(int level) {
+        // without overviews, RasterIO would read the full resolution window of every
+        // reduced tile, the pyramid computed from the tiles is cheaper
+        GDALDataset* g = handles->acquire();
+        if (!g)
+            return nullptr;
+        int overviews = g->GetRasterBand(1)->GetOverviewCount();
+        handles->release(g);
+        if (overviews == 0)
+            return nullptr;
+
+        size_t lw = w;
+        size_t lh = h;
+        for (int l = 0; l < level; l++) {
+            lw = (lw + 1) / 2;
+            lh = (lh + 1) / 2;
+        }
+        return std::make_shared<GDALTileSource>(handles, tilew, tileh, d, tf, asktype,
+                                                rasterw, rasterh, lw, lh, scale << level);
+    }
+};
+
+// align the tiles on the blocks of the file when they have a reasonable size
+static size_t getGDALTileSize(int block)
+{
+    if (block >= 256 && block <= 2048)
+        return block;
+    return 512;
+}
+
 void GDALFileImageProvider::progress()
 {
     GDALDataset* g = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
     if (!g) {
-        onFinish(makeError("gdal: cannot load image '" + filename + "'"));
+        return onFinish(makeError("gdal: cannot load image '" + filename + "'"));
     }
 
     int w = g->GetRasterXSize();
@@ -52,6 +209,17 @@ void GDALFileImageProvider::progress()
             tf = 2;
         }
     }
+
+    if ((size_t) w * h >= TILED_LOADING_MIN_PIXELS && d > 0) {
+        int bw, bh;
+        g->GetRasterBand(1)->GetBlockSize(&bw, &bh);
+        auto handles = std::make_shared<GDALHandles>(filename);
+        handles->release(g);
+        auto tiles = std::make_shared<GDALTileSource>(handles, getGDALTileSize(bw), getGDALTileSize(bh),
+                                                      d, tf, asktype, w, h, w, h);
+        return onFinish(std::make_shared<Image>(tiles, w, h, d * tf, SAMPLE_FLOAT32));
+    }
+
     float* pixels = (float*) malloc(sizeof(float) * w * h * d * tf);
     GDALRasterIOExtraArg args;
     INIT_RASTERIO_EXTRA_ARG(args);
@@ -102,9 +270,6 @@ JPEGFileImageProvider::~JPEGFileImageProvider()
     if (pixels) {
         free(pixels);
     }
-    if (scanline) {
-        delete[] scanline;
-    }
 }
 
 void JPEGFileImageProvider::onJPEGError(const std::string& error)
@@ -121,6 +286,61 @@ float JPEGFileImageProvider::getProgressPercentage() const {
     }
 }
 
+// minimal decoded rows per progress() call, rounded up to the rows libjpeg outputs at once
+#define JPEG_ROWS_PER_STEP 64
+// images with fewer pixels are decoded directly
+#define JPEG_PREVIEW_MIN_PIXELS (4<<20)
+// the preview is the smallest scaling (up to 1/8) that keeps this size
+#define JPEG_PREVIEW_SIZE 1024
+
+std::shared_ptr<Image> JPEGFileImageProvider::getPreview(int& scale) const
+{
+    std::shared_ptr<Image> image = std::atomic_load(&preview);
+    scale = previewScale;
+    return image;
+}
+
+// decodes the whole image with the DCT scaling of libjpeg, and rewinds the file for the full decoding
+// returns false on error
+bool JPEGFileImageProvider::decodePreview()
+{
+    size_t size = std::max(cinfo->image_width, cinfo->image_height);
+    int denom = 1;
+    while (denom < 8 && size / (denom * 2) >= JPEG_PREVIEW_SIZE)
+        denom *= 2;
+    if (denom == 1)
+        return true;
+
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = denom;
+    jpeg_start_decompress(cinfo);
+    if (error) return false;
+
+    size_t rowwidth = cinfo->output_width*cinfo->output_components;
+    unsigned char* data = (unsigned char*) malloc(rowwidth*cinfo->output_height);
+    while (cinfo->output_scanline < cinfo->output_height) {
+        unsigned char* scanline = data + (size_t)cinfo->output_scanline*rowwidth;
+        jpeg_read_scanlines(cinfo, &scanline, 1);
+        if (error) {
+            free(data);
+            return false;
+        }
+    }
+    std::shared_ptr<Image> image = std::make_shared<Image>(data,
+                           cinfo->output_width, cinfo->output_height, cinfo->output_components,
+                           SAMPLE_UINT8);
+
+    jpeg_abort_decompress(cinfo);
+    fseek(file, 0, SEEK_SET);
+    jpeg_stdio_src(cinfo, file);
+    jpeg_read_header(cinfo, TRUE);
+    if (error) return false;
+
+    previewScale = denom;
+    std::atomic_store(&preview, image);
+    return true;
+}
+
 void JPEGFileImageProvider::progress()
 {
     assert(!error);
@@ -144,24 +364,38 @@ void JPEGFileImageProvider::progress()
         jpeg_read_header(cinfo, TRUE);
         if (error) return;
 
+        if (gJpegPreview && previewRequested && (size_t) cinfo->image_width * cinfo->image_height >= JPEG_PREVIEW_MIN_PIXELS) {
+            if (!decodePreview()) return;
+        }
+
         jpeg_start_decompress(cinfo);
         if (error) return;
 
-        pixels = (float*) malloc(sizeof(float)*cinfo->output_width*cinfo->output_height*cinfo->output_components);
-        scanline = new unsigned char[cinfo->output_width*cinfo->output_components];
+        pixels = (unsigned char*) malloc(sizeof(*pixels)*cinfo->output_width*cinfo->output_height*cinfo->output_components);
     } else if (cinfo->output_scanline < cinfo->output_height) {
-        jpeg_read_scanlines(cinfo, &scanline, 1);
-        if (error) return;
+        // decode directly into the image, the samples are kept as 8 bits
+        // libjpeg outputs at most rec_outbuf_height rows per call
         size_t rowwidth = cinfo->output_width*cinfo->output_components;
-        for (size_t j = 0; j < rowwidth; j++) {
-            pixels[(size_t)(cinfo->output_scanline-1)*rowwidth + j] = scanline[j];
+        size_t rows = std::max(JPEG_ROWS_PER_STEP, cinfo->rec_outbuf_height);
+        rows = std::min(rows, (size_t) (cinfo->output_height - cinfo->output_scanline));
+        std::vector<JSAMPROW> scanlines(rows);
+        for (size_t i = 0; i < rows; i++) {
+            scanlines[i] = pixels + ((size_t)cinfo->output_scanline + i)*rowwidth;
+        }
+        size_t done = 0;
+        while (done < rows) {
+            size_t read = jpeg_read_scanlines(cinfo, &scanlines[done], rows - done);
+            if (error) return;
+            if (!read) break;
+            done += read;
         }
     } else {
         jpeg_finish_decompress(cinfo);
         if (error) return;
 
         std::shared_ptr<Image> image = std::make_shared<Image>(pixels,
-                               cinfo->output_width, cinfo->output_height, cinfo->output_components);
+                               cinfo->output_width, cinfo->output_height, cinfo->output_components,
+                               SAMPLE_UINT8);
         onFinish(image);
         pixels = nullptr;
     }
@@ -169,6 +403,23 @@ void JPEGFileImageProvider::progress()
 
 #include <png.h>
 
+// bytes given to libpng per progress() call
+#define PNG_READ_SIZE (1<<20)
+
+// the 16 bits samples of PNG are big endian
+static void swapBytes16(uint16_t* samples, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = (uint16_t) ((samples[i] >> 8) | (samples[i] << 8));
+    }
+}
+
+static bool isLittleEndian()
+{
+    uint16_t one = 1;
+    return *(uint8_t*) &one;
+}
+
 struct PNGPrivate {
     PNGFileImageProvider* provider;
 
@@ -178,8 +429,10 @@ struct PNGPrivate {
     uint32_t width, height;
     int channels;
     int depth;
+    bool interlaced;
+    size_t rowbytes;
     uint32_t cur;
-    float* pixels;
+    // the pixels of the image, the rows are decoded directly in it
     png_bytep pngframe;
 
     uint32_t length;
@@ -187,7 +440,7 @@ struct PNGPrivate {
 
     PNGPrivate(PNGFileImageProvider* provider)
         : provider(provider), file(nullptr), png_ptr(nullptr), info_ptr(nullptr),
-          height(0), pixels(nullptr), pngframe(nullptr),  buffer(nullptr)
+          height(0), interlaced(false), rowbytes(0), pngframe(nullptr),  buffer(nullptr)
     {}
 
     ~PNGPrivate() {
@@ -197,9 +450,6 @@ struct PNGPrivate {
         if (pngframe) {
             free(pngframe);
         }
-        if (pixels) {
-            free(pixels);
-        }
         if (buffer) {
             free(buffer);
         }
@@ -212,59 +462,67 @@ struct PNGPrivate {
     {
         width = png_get_image_width(png_ptr, info_ptr);
         height = png_get_image_height(png_ptr, info_ptr);
-        channels = png_get_channels(png_ptr, info_ptr);
-        depth = png_get_bit_depth(png_ptr, info_ptr);
-        pixels = (float*) malloc(sizeof(float)*width*height*channels);
-        pngframe = (png_bytep) malloc(sizeof(*pngframe) * width*height*channels*depth/8);
 
-        if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        // palettes are expanded to RGB, and 1, 2 and 4 bits samples are unpacked
+        // to one byte each, keeping their values
+        if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE) {
+            png_set_palette_to_rgb(png_ptr);
+            if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+                png_set_tRNS_to_alpha(png_ptr);
+            }
+        }
+        if (png_get_bit_depth(png_ptr, info_ptr) < 8) {
+            png_set_packing(png_ptr);
+        }
+
+        interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+        if (interlaced) {
             png_set_interlace_handling(png_ptr);
         }
 
-        png_start_read_image(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+        channels = png_get_channels(png_ptr, info_ptr);
+        depth = png_get_bit_depth(png_ptr, info_ptr);
+        rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+        pngframe = (png_bytep) malloc(sizeof(*pngframe) * rowbytes * height);
     }
 
     void row_callback(png_bytep new_row, png_uint_32 row_num, int pass)
     {
         if (new_row) {
-            // TODO: is this valid for 1bit/pixel ?
-            png_progressive_combine_row(png_ptr, pngframe+row_num*width*channels*depth/8, new_row);
+            png_bytep row = pngframe + row_num*rowbytes;
+            png_progressive_combine_row(png_ptr, row, new_row);
+            // the row is still in cache, unless later passes will update it
+            if (depth == 16 && !interlaced && isLittleEndian()) {
+                swapBytes16((uint16_t*) row, width*channels);
+            }
         }
         cur = row_num;
     }
 
     void end_callback()
     {
+        if (depth == 16 && interlaced && isLittleEndian()) {
+            swapBytes16((uint16_t*) pngframe, (size_t) width*height*channels);
+        }
     }
 
     std::shared_ptr<Image> getImage()
     {
+        std::shared_ptr<Image> img;
         switch (depth) {
-            case 1:
-                for (size_t i = 0; i < width*height*channels/8; i++) {
-                    for (int b = 7; b >= 0; b--)
-                        pixels[i*8 + 7 - b] = !!(pngframe[i] & (1<<b));
-                }
-                break;
             case 8:
-                for (size_t i = 0; i < width*height*channels; i++) {
-                    pixels[i] = *(pngframe + i);
-                }
+                // the frame is already what we want
+                img = std::make_shared<Image>(pngframe, width, height, channels, SAMPLE_UINT8);
+                pngframe = nullptr;
                 break;
             case 16:
-                for (size_t i = 0; i < width*height*channels; i++) {
-                    png_byte *b = (pngframe + i * 2);
-                    std::swap(b[0], b[1]);
-                    uint16_t sample = *(uint16_t *)b;
-                    pixels[i] = sample;
-                }
+                img = std::make_shared<Image>(pngframe, width, height, channels, SAMPLE_UINT16);
+                pngframe = nullptr;
                 break;
             default:
                 return nullptr;
         }
-
-        auto img = std::make_shared<Image>(pixels, width, height, channels);
-        pixels = nullptr;
         return img;
     }
 };
@@ -349,7 +607,7 @@ void PNGFileImageProvider::progress()
             return;
         }
 
-        p->length = 1<<12;
+        p->length = PNG_READ_SIZE;
         p->buffer = (png_bytep) malloc(sizeof(*p->buffer) * p->length);
         p->cur = 0;
     } else if (!feof(p->file)) {
@@ -384,19 +642,78 @@ void PNGFileImageProvider::onPNGError(const std::string& error)
 
 #include <tiffio.h>
 
+// decoded bytes of the strips or tiles read by each chunk per progress() call
+#define TIFF_BYTES_PER_CHUNK (4<<20)
+
+static TIFF* openTIFF(const std::string& filename, bool ycbcr)
+{
+    // libtiff maps the file, except in watch mode where it can be truncated while being read
+    TIFF* tif = TIFFOpen(filename.c_str(), watcher_is_enabled() ? "rm" : "r");
+    // let libjpeg convert the subsampled chroma
+    if (tif && ycbcr)
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+    return tif;
+}
+
+// handles of a file for the threads decoding it, a TIFF* can't be used by two threads at once
+// a reader takes one for the time of its read, another one is opened if none is free
+struct TIFFHandles {
+    std::string filename;
+    bool ycbcr;
+    std::mutex lock;
+    std::vector<TIFF*> handles;
+
+    TIFFHandles(const std::string& filename, bool ycbcr) : filename(filename), ycbcr(ycbcr) {
+    }
+
+    ~TIFFHandles() {
+        for (TIFF* tif : handles) {
+            TIFFClose(tif);
+        }
+    }
+
+    // nullptr if the file can't be opened anymore
+    TIFF* acquire() {
+        {
+            std::lock_guard<std::mutex> _lock(lock);
+            if (!handles.empty()) {
+                TIFF* tif = handles.back();
+                handles.pop_back();
+                return tif;
+            }
+        }
+        return openTIFF(filename, ycbcr);
+    }
+
+    void release(TIFF* tif) {
+        std::lock_guard<std::mutex> _lock(lock);
+        handles.push_back(tif);
+    }
+};
+
 struct TIFFPrivate {
     TIFFFileImageProvider* provider;
     TIFF* tif;
     uint32_t w, h;
     uint16_t spp, bps, fmt;
-    float* data;
-    uint8_t* buf;
-    bool broken;
-    uint32_t curh;
-    int sls;
+    bool separate;
+    bool tiled;
+    bool ycbcr;
+    // type of the decoded samples and of the image
+    SampleType type;
+    void* data;
+
+    // the decoding units are the strips or the tiles, of each plane when separate
+    uint32_t unitw, unith;
+    size_t unitsize;
+    uint32_t nunits;
+    uint32_t curunit;
+    // once decoding, 'tif' is moved to the handles shared by the chunks
+    std::shared_ptr<TIFFHandles> handles;
 
     TIFFPrivate(TIFFFileImageProvider* provider)
-        : provider(provider), tif(nullptr), h(0), data(nullptr), buf(nullptr), curh(0)
+        : provider(provider), tif(nullptr), h(0), separate(false), tiled(false), ycbcr(false),
+          data(nullptr), unitsize(0), nunits(0), curunit(0)
     {
     }
 
@@ -407,11 +724,64 @@ struct TIFFPrivate {
         }
         if (data)
             free(data);
-        if (buf)
-            free(buf);
     }
 };
 
+struct TIFFTileSource : TileSource {
+    std::shared_ptr<TIFFHandles> handles;
+    uint32_t w, h;
+    uint16_t spp;
+    SampleType type;
+
+    TIFFTileSource(std::shared_ptr<TIFFHandles> handles, uint32_t w, uint32_t h, uint16_t spp,
+                   uint32_t tilew, uint32_t tileh, SampleType type)
+        : TileSource(tilew, tileh), handles(handles), w(w), h(h), spp(spp), type(type) {
+    }
+
+    std::shared_ptr<Image> readTile(size_t tx, size_t ty) {
+        size_t x = tx * tilew;
+        size_t y = ty * tileh;
+        if (x >= w || y >= h)
+            return nullptr;
+        size_t cw = std::min(tilew, w - x);
+        size_t ch = std::min(tileh, h - y);
+        size_t pixelsize = spp * getSampleSize(type);
+
+        // the loading threads read their tiles concurrently, each with its own handle
+        TIFF* tif = handles->acquire();
+        if (!tif)
+            return nullptr;
+        // a tile smaller than expected would be read past its end
+        std::vector<uint8_t> buf(TIFFTileSize(tif));
+        bool ok = buf.size() >= tilew * tileh * pixelsize
+                  && TIFFReadTile(tif, buf.data(), x, y, 0, 0) >= 0;
+        handles->release(tif);
+        if (!ok)
+            return nullptr;
+
+        // crop the tiles on the right and bottom borders
+        uint8_t* pixels = (uint8_t*) malloc(cw * ch * pixelsize);
+        for (size_t r = 0; r < ch; r++) {
+            memcpy(pixels + r * cw * pixelsize, buf.data() + r * tilew * pixelsize, cw * pixelsize);
+        }
+        return std::make_shared<Image>(pixels, cw, ch, spp, type);
+    }
+};
+
+static bool getTIFFSampleType(uint16_t fmt, uint16_t bps, SampleType& type)
+{
+    if (fmt == SAMPLEFORMAT_UINT && bps == 8) {
+        type = SAMPLE_UINT8;
+    } else if (fmt == SAMPLEFORMAT_UINT && bps == 16) {
+        type = SAMPLE_UINT16;
+    } else if (fmt == SAMPLEFORMAT_IEEEFP && bps == 32) {
+        type = SAMPLE_FLOAT32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 TIFFFileImageProvider::~TIFFFileImageProvider()
 {
     if (p) {
@@ -421,16 +791,116 @@ TIFFFileImageProvider::~TIFFFileImageProvider()
 
 float TIFFFileImageProvider::getProgressPercentage() const
 {
-    if (p && p->h)
-        return (float) p->curh / p->h;
+    if (p && p->nunits)
+        return (float) p->curunit / p->nunits;
     return 0.f;
 }
 
+template <typename S, typename D>
+static void convertSamples(const S* src, size_t n, size_t srcstride, D* dst, size_t dststride)
+{
+    if (srcstride == 1 && dststride == 1) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i];
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            dst[i*dststride] = src[i*srcstride];
+        }
+    }
+}
+
+// whether convertTIFFSamples handles the format, the others are left to iio
+static bool isTIFFFormatSupported(uint16_t fmt, uint16_t bps)
+{
+    switch (fmt) {
+        case SAMPLEFORMAT_IEEEFP:
+            return bps == 32 || bps == 64;
+        case SAMPLEFORMAT_INT:
+        case SAMPLEFORMAT_UINT:
+            return bps == 8 || bps == 16 || bps == 32;
+        case SAMPLEFORMAT_VOID:
+            return bps == 8 || bps == 16;
+    }
+    return false;
+}
+
+// converts n samples of the file format to the image type
+// returns false if the format is not supported
+template <typename D>
+static bool convertTIFFSamples(const uint8_t* src, uint16_t fmt, uint16_t bps,
+                               size_t n, size_t srcstride, D* dst, size_t dststride)
+{
+#define CONVERT(T) convertSamples((const T*) src, n, srcstride, dst, dststride); return true
+    if (fmt == SAMPLEFORMAT_IEEEFP) {
+        if (bps == 32) { CONVERT(float); }
+        if (bps == 64) { CONVERT(double); }
+    } else if (fmt == SAMPLEFORMAT_INT) {
+        if (bps == 8) { CONVERT(int8_t); }
+        if (bps == 16) { CONVERT(int16_t); }
+        if (bps == 32) { CONVERT(int32_t); }
+    } else if (fmt == SAMPLEFORMAT_UINT || fmt == SAMPLEFORMAT_VOID) {
+        if (bps == 8) { CONVERT(uint8_t); }
+        if (bps == 16) { CONVERT(uint16_t); }
+        if (bps == 32 && fmt == SAMPLEFORMAT_UINT) { CONVERT(uint32_t); }
+    }
+#undef CONVERT
+    return false;
+}
+
+// decodes the strip or tile 'unit' into the image, returns false on error
+static bool readTIFFUnit(TIFFPrivate* p, TIFF* tif, uint32_t unit, std::vector<uint8_t>& buf)
+{
+    tmsize_t r;
+    if (p->tiled)
+        r = TIFFReadEncodedTile(tif, unit, buf.data(), buf.size());
+    else
+        r = TIFFReadEncodedStrip(tif, unit, buf.data(), buf.size());
+    if (r < 0)
+        return false;
+
+    uint32_t unitsacross = (p->w + p->unitw - 1) / p->unitw;
+    uint32_t unitsdown = (p->h + p->unith - 1) / p->unith;
+    uint32_t plane = unit / (unitsacross * unitsdown);
+    uint32_t index = unit % (unitsacross * unitsdown);
+    size_t x0 = (index % unitsacross) * p->unitw;
+    size_t y0 = (index / unitsacross) * p->unith;
+    size_t cw = std::min<size_t>(p->unitw, p->w - x0);
+    size_t ch = std::min<size_t>(p->unith, p->h - y0);
+
+    // a separate plane fills every spp-th sample of the image
+    size_t unitspp = p->separate ? 1 : p->spp;
+    size_t srcrow = (size_t) p->unitw * unitspp * (p->bps / 8);
+    size_t dstsize = getSampleSize(p->type);
+    for (size_t y = 0; y < ch; y++) {
+        const uint8_t* src = buf.data() + y * srcrow;
+        size_t offset = ((y0 + y) * p->w + x0) * p->spp + plane;
+        uint8_t* dst = (uint8_t*) p->data + offset * dstsize;
+        size_t n = cw * unitspp;
+        size_t dststride = p->separate ? p->spp : 1;
+        bool ok = false;
+        switch (p->type) {
+            case SAMPLE_UINT8:
+                ok = convertTIFFSamples(src, p->fmt, p->bps, n, 1, (uint8_t*) dst, dststride);
+                break;
+            case SAMPLE_UINT16:
+                ok = convertTIFFSamples(src, p->fmt, p->bps, n, 1, (uint16_t*) dst, dststride);
+                break;
+            case SAMPLE_FLOAT32:
+                ok = convertTIFFSamples(src, p->fmt, p->bps, n, 1, (float*) dst, dststride);
+                break;
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
 void TIFFFileImageProvider::progress()
 {
     if (!p) {
         p = new TIFFPrivate(this);
-        p->tif = TIFFOpen(filename.c_str(), "rm");
+        p->tif = openTIFF(filename, false);
         if (!p->tif) return onFinish(makeError("cannot read tiff " + filename));
 
         int r = 0;
@@ -451,7 +921,8 @@ void TIFFFileImageProvider::progress()
         if (!r)
             p->fmt = SAMPLEFORMAT_UINT;
 
-        if (p->fmt == SAMPLEFORMAT_COMPLEXINT || p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP) {
+        bool complex = p->fmt == SAMPLEFORMAT_COMPLEXINT || p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP;
+        if (complex) {
             p->spp *= 2;
             p->bps /= 2;
         }
@@ -463,36 +934,100 @@ void TIFFFileImageProvider::progress()
         uint16_t planarity;
         r = TIFFGetField(p->tif, TIFFTAG_PLANARCONFIG, &planarity);
         if (r != 1) planarity = PLANARCONFIG_CONTIG;
-        p->broken = planarity == PLANARCONFIG_SEPARATE;
-
-        uint32_t scanline_size = (p->w * p->spp * p->bps)/8;
-        int rbps = (p->bps/8) ? (p->bps/8) : 1;
-        p->sls = TIFFScanlineSize(p->tif);
-        if ((int)scanline_size != p->sls)
-            fprintf(stderr, "scanline_size,sls = %d,%d\n", (int)scanline_size, p->sls);
-        //assert((int)scanline_size == sls);
-        if (!p->broken)
-            assert((int)scanline_size == p->sls);
-        assert((int)scanline_size >= p->sls);
-        p->data = (float*) malloc(p->w * p->h * p->spp * rbps);
-        p->buf = (uint8_t*) malloc(scanline_size);
-        p->curh = 0;
-
-        if (TIFFIsTiled(p->tif) || p->fmt != SAMPLEFORMAT_IEEEFP || p->broken || rbps != sizeof(float)) {
+        p->separate = planarity == PLANARCONFIG_SEPARATE && p->spp > 1;
+        p->tiled = TIFFIsTiled(p->tif);
+
+        uint16_t photometric = 0, compression = COMPRESSION_NONE;
+        TIFFGetField(p->tif, TIFFTAG_PHOTOMETRIC, &photometric);
+        TIFFGetField(p->tif, TIFFTAG_COMPRESSION, &compression);
+        p->ycbcr = photometric == PHOTOMETRIC_YCBCR && compression == COMPRESSION_JPEG;
+        if (p->ycbcr) {
+            TIFFSetField(p->tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+        }
+
+        // the handles of the tile source upsample the JPEG tiles to RGB too
+        SampleType type;
+        if (p->tiled && !p->separate && getTIFFSampleType(p->fmt, p->bps, type)
+            && !(photometric == PHOTOMETRIC_YCBCR && !p->ycbcr)
+            && (size_t) p->w * p->h >= TILED_LOADING_MIN_PIXELS) {
+            uint32_t tilew, tileh;
+            TIFFGetField(p->tif, TIFFTAG_TILEWIDTH, &tilew);
+            TIFFGetField(p->tif, TIFFTAG_TILELENGTH, &tileh);
+            auto handles = std::make_shared<TIFFHandles>(filename, p->ycbcr);
+            handles->release(p->tif);
+            p->tif = nullptr;
+            auto tiles = std::make_shared<TIFFTileSource>(handles, p->w, p->h, p->spp, tilew, tileh, type);
+            return onFinish(std::make_shared<Image>(tiles, p->w, p->h, p->spp, type));
+        }
+
+        // samples that are not byte-aligned and subsampled chroma are left to iio
+        bool supported = isTIFFFormatSupported(p->fmt, p->bps);
+        supported &= !(photometric == PHOTOMETRIC_YCBCR && !p->ycbcr);
+        supported &= !(complex && p->separate);
+        if (!supported) {
             std::shared_ptr<Image> image = load_from_iio(filename);
             if (!image) {
                 onFinish(makeError("iio: cannot load image '" + filename + "'"));
             } else {
                 onFinish(image);
             }
+            return;
+        }
+
+        // 8 and 16 bits unsigned samples are kept as is, the others become floats
+        if (!getTIFFSampleType(p->fmt, p->bps, p->type))
+            p->type = SAMPLE_FLOAT32;
+
+        if (p->tiled) {
+            TIFFGetField(p->tif, TIFFTAG_TILEWIDTH, &p->unitw);
+            TIFFGetField(p->tif, TIFFTAG_TILELENGTH, &p->unith);
+            p->nunits = TIFFNumberOfTiles(p->tif);
+        } else {
+            uint32_t rowsperstrip;
+            if (!TIFFGetField(p->tif, TIFFTAG_ROWSPERSTRIP, &rowsperstrip) || rowsperstrip > p->h)
+                rowsperstrip = p->h;
+            p->unitw = p->w;
+            p->unith = rowsperstrip;
+            p->nunits = TIFFNumberOfStrips(p->tif);
+        }
+        p->unitsize = p->tiled ? TIFFTileSize(p->tif) : TIFFStripSize(p->tif);
+        p->data = malloc((size_t) p->w * p->h * p->spp * getSampleSize(p->type));
+        p->curunit = 0;
+        p->handles = std::make_shared<TIFFHandles>(filename, p->ycbcr);
+        p->handles->release(p->tif);
+        p->tif = nullptr;
+    } else if (p->curunit < p->nunits) {
+        // the units are compressed independently, each chunk decodes a few with its own handle
+        // the chunks have the same amount of decoded bytes whether the units are rows or tiles
+        uint32_t first = p->curunit;
+        size_t remaining = p->nunits - first;
+        size_t perchunk = std::max<size_t>(1, TIFF_BYTES_PER_CHUNK / std::max<size_t>(1, p->unitsize));
+        size_t nchunks = parallel_chunks(remaining, perchunk);
+        uint32_t end = first + std::min(remaining, nchunks * perchunk);
+        std::vector<char> ok(nchunks, true);
+        parallel_for(end - first, nchunks, [&](size_t t, size_t begin, size_t stop) {
+            if (begin == stop)
+                return;
+            TIFF* tif = p->handles->acquire();
+            if (!tif) {
+                ok[t] = false;
+                return;
+            }
+            std::vector<uint8_t> buf(p->unitsize);
+            for (size_t unit = first + begin; unit < first + stop; unit++) {
+                if (!readTIFFUnit(p, tif, unit, buf))
+                    ok[t] = false;
+            }
+            p->handles->release(tif);
+        });
+
+        for (size_t t = 0; t < nchunks; t++) {
+            if (!ok[t])
+                return onFinish(makeError("error reading tiff " + filename));
         }
-    } else if (p->curh < p->h) {
-        int r = TIFFReadScanline(p->tif, p->buf, p->curh);
-        if (r < 0) onFinish(makeError("error reading tiff row " + std::to_string(p->curh)));
-        memcpy(p->data + p->curh * p->sls/sizeof(float), p->buf, p->sls);
-        p->curh++;
+        p->curunit = end;
     } else {
-        std::shared_ptr<Image> image = std::make_shared<Image>(p->data, p->w, p->h, p->spp);
+        std::shared_ptr<Image> image = std::make_shared<Image>(p->data, p->w, p->h, p->spp, p->type);
         onFinish(image);
         p->data = nullptr;
     }
@@ -500,20 +1035,67 @@ void TIFFFileImageProvider::progress()
 
 #ifdef USE_LIBRAW
 #include "libraw/libraw.h"
+#include <sys/stat.h>
+
+// rows copied by each thread at least
+#define RAW_ROWS_PER_THREAD 256
+
+struct RAWPrivate {
+    LibRaw processor;
+};
+
+// whether libraw could open a file, with the modification time and size of the file when probed
+struct RAWProbe {
+    time_t mtime;
+    off_t size;
+    bool ok;
+};
+
+static std::mutex rawProbesLock;
+static std::unordered_map<std::string, RAWProbe> rawProbes;
+#else
+struct RAWPrivate {
+};
 #endif
 
-bool RAWFileImageProvider::canOpen(const std::string& filename)
+std::shared_ptr<RAWFileImageProvider> RAWFileImageProvider::open(const std::string& filename)
 {
 #ifdef USE_LIBRAW
-    LibRaw processor;
-    return processor.open_file(filename.c_str()) == LIBRAW_SUCCESS;
+    struct stat st;
+    bool exists = stat(filename.c_str(), &st) == 0;
+    if (exists) {
+        std::lock_guard<std::mutex> _lock(rawProbesLock);
+        auto it = rawProbes.find(filename);
+        if (it != rawProbes.end() && it->second.mtime == st.st_mtime && it->second.size == st.st_size) {
+            if (!it->second.ok)
+                return nullptr;
+            // the file will be opened when loading
+            return std::make_shared<RAWFileImageProvider>(filename);
+        }
+    }
+
+    // the file stays open for the provider, so that it is not opened twice
+    RAWPrivate* p = new RAWPrivate;
+    bool ok = p->processor.open_file(filename.c_str()) == LIBRAW_SUCCESS;
+    if (exists) {
+        std::lock_guard<std::mutex> _lock(rawProbesLock);
+        rawProbes[filename] = RAWProbe{st.st_mtime, st.st_size, ok};
+    }
+    if (!ok) {
+        delete p;
+        return nullptr;
+    }
+    return std::make_shared<RAWFileImageProvider>(filename, p);
 #else
-    return false;
+    return nullptr;
 #endif
 }
 
 RAWFileImageProvider::~RAWFileImageProvider()
 {
+    if (p) {
+        delete p;
+    }
 }
 
 float RAWFileImageProvider::getProgressPercentage() const
@@ -525,47 +1107,228 @@ float RAWFileImageProvider::getProgressPercentage() const
 void RAWFileImageProvider::progress()
 {
 #ifdef USE_LIBRAW
-    LibRaw* processor = new LibRaw;
     int ret;
-    if ((ret = processor->open_file(filename.c_str())) != LIBRAW_SUCCESS) {
-        onFinish(makeError("libraw: cannot open " + filename + " " + libraw_strerror(ret)));
-        goto end;
+    if (!p) {
+        p = new RAWPrivate;
+        if ((ret = p->processor.open_file(filename.c_str())) != LIBRAW_SUCCESS) {
+            onFinish(makeError("libraw: cannot open " + filename + " " + libraw_strerror(ret)));
+            goto end;
+        }
     }
 
-    if ((ret = processor->unpack() ) != LIBRAW_SUCCESS) {
+    if ((ret = p->processor.unpack()) != LIBRAW_SUCCESS) {
         onFinish(makeError("libraw: cannot unpack " + filename + " " + libraw_strerror(ret)));
         goto end;
     }
 
-    if (!processor->imgdata.idata.filters && processor->imgdata.idata.colors != 1) {
+    if ((!p->processor.imgdata.idata.filters && p->processor.imgdata.idata.colors != 1)
+        || !p->processor.imgdata.rawdata.raw_image) {
         onFinish(makeError("libraw: only bayer-pattern RAW files supported"));
         goto end;
     }
 
     {
-        int w = processor->imgdata.sizes.raw_width;
-        int h = processor->imgdata.sizes.raw_height;
-        int d = 1;
-        float* data = (float*) malloc(sizeof(float)*w*h*d);
-
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                data[y*w+x] = processor->imgdata.rawdata.raw_image[y*w+x];
+        // the samples are kept as 16 bits, the rows are copied without their padding
+        size_t w = p->processor.imgdata.sizes.raw_width;
+        size_t h = p->processor.imgdata.sizes.raw_height;
+        size_t pitch = p->processor.imgdata.sizes.raw_pitch / sizeof(uint16_t);
+        const uint16_t* raw = p->processor.imgdata.rawdata.raw_image;
+        uint16_t* data = (uint16_t*) malloc(sizeof(uint16_t)*w*h);
+
+        parallel_for(h, parallel_chunks(h, RAW_ROWS_PER_THREAD), [&](size_t, size_t y0, size_t y1) {
+            for (size_t y = y0; y < y1; y++) {
+                memcpy(data + y * w, raw + y * pitch, sizeof(uint16_t) * w);
             }
-        }
+        });
 
-        std::shared_ptr<Image> image = std::make_shared<Image>(data, w, h, d);
+        std::shared_ptr<Image> image = std::make_shared<Image>(data, w, h, 1, SAMPLE_UINT16);
         onFinish(image);
     }
 end:
-    delete processor;
+    // releases the raw buffer of libraw
+    delete p;
+    p = nullptr;
 #endif
 }
 
+// reduced input of a preview edit, from the pyramid if the level is already built
+static std::shared_ptr<Image> downscaleImage(const std::shared_ptr<Image>& image, int downscale)
+{
+    int level = 0;
+    while ((1 << (level + 1)) <= downscale)
+        level++;
+    if ((1 << level) == downscale && level <= Pyramid::getMaxLevel(*image)) {
+        std::shared_ptr<Image> reduced = image->pyramid->getLevel(*image, level);
+        if (reduced)
+            return reduced;
+    }
+
+    // otherwise keep one pixel out of 'downscale' in each direction
+    size_t w = (image->w + downscale - 1) / downscale;
+    size_t h = (image->h + downscale - 1) / downscale;
+    size_t c = image->c;
+    float* pixels = (float*) malloc(sizeof(float) * w * h * c);
+    std::vector<float> row(w);
+    for (size_t y = 0; y < h; y++) {
+        for (size_t d = 0; d < c; d++) {
+            size_t offset = (y * downscale * image->w) * c + d;
+            image->getSamples(offset, w, downscale * c, row.data());
+            for (size_t x = 0; x < w; x++) {
+                pixels[(y * w + x) * c + d] = row[x];
+            }
+        }
+    }
+    return std::make_shared<Image>(pixels, w, h, c);
+}
+
+std::shared_ptr<EditBatch> EditBatch::get(const std::string& key,
+                                          const std::function<std::shared_ptr<EditBatch>()>& create)
+{
+    static std::mutex lock;
+    static std::unordered_map<std::string, std::weak_ptr<EditBatch>> batches;
+
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        std::shared_ptr<EditBatch> batch = batches[key].lock();
+        if (batch) {
+            return batch;
+        }
+    }
+
+    // create() makes the providers of the inputs, don't hold the lock
+    std::shared_ptr<EditBatch> batch = create();
+
+    std::lock_guard<std::mutex> _lock(lock);
+    for (auto it = batches.begin(); it != batches.end();) {
+        if (it->second.expired())
+            it = batches.erase(it);
+        else
+            it++;
+    }
+    std::shared_ptr<EditBatch> other = batches[key].lock();
+    if (other) {
+        return other;
+    }
+    batches[key] = batch;
+    return batch;
+}
+
+float EditBatch::getProgressPercentage() const
+{
+    if (loaded) return 1.f;
+    float percent = 0.f;
+    size_t n = 0;
+    for (auto& frame : providers) {
+        for (auto p : frame) {
+            percent += p->getProgressPercentage();
+            n++;
+        }
+    }
+    return percent / (n + 1); // +1 because of the edition time
+}
+
+void EditBatch::progress()
+{
+    for (auto& frame : providers) {
+        for (auto p : frame) {
+            if (!p->isLoaded()) {
+                p->progressExclusively();
+                return;
+            }
+        }
+    }
+
+    // the frames with an input in error are not edited
+    std::vector<std::vector<std::shared_ptr<Image>>> frames;
+    std::vector<size_t> indices;
+    for (size_t k = 0; k < providers.size(); k++) {
+        std::vector<std::shared_ptr<Image>> frame;
+        for (auto p : providers[k]) {
+            ImageProvider::Result result = p->getResult();
+            if (!result.has_value()) {
+                errors[k] = result.error();
+                break;
+            }
+            std::shared_ptr<Image> image = result.value();
+            image->addUser(keys[k]);
+            frame.push_back(image);
+        }
+        if (errors[k].empty()) {
+            frames.push_back(frame);
+            indices.push_back(k);
+        }
+    }
+
+    if (!frames.empty()) {
+        std::string error;
+        std::vector<std::shared_ptr<Image>> results = edit_images_batch(edittype, editprog, frames, error);
+        for (size_t j = 0; j < indices.size(); j++) {
+            if (results.empty()) {
+                errors[indices[j]] = "cannot edit: " + error;
+            } else {
+                images[indices[j]] = results[j];
+            }
+        }
+    }
+
+    // the batch dies with the providers of the requested frames, the other frames
+    // of the group are only found again through the cache
+    for (size_t k = 0; k < keys.size(); k++) {
+        if (images[k]) {
+            ImageCache::store(keys[k], images[k]);
+        } else {
+            ImageCache::Error::store(keys[k], errors[k]);
+        }
+    }
+
+    loaded = true;
+}
+
+void WholeImageProvider::progress()
+{
+    std::shared_ptr<Image> whole = tiled->tiles->computeWhole();
+    if (!whole) {
+        // keep showing the tiled image
+        return onFinish(tiled);
+    }
+    for (const std::string& user : tiled->getUsers()) {
+        whole->addUser(user);
+    }
+    ImageCache::remove(key);
+    ImageCache::store(key, whole);
+    onFinish(whole);
+}
+
+std::shared_ptr<Image> EditBatch::getImage(const std::string& key, std::string& error) const
+{
+    for (size_t k = 0; k < keys.size(); k++) {
+        if (keys[k] == key) {
+            error = errors[k];
+            return images[k];
+        }
+    }
+    error = "frame not in the batch";
+    return nullptr;
+}
+
 void EditedImageProvider::progress() {
+    if (batch) {
+        batch->progressExclusively();
+        if (batch->isLoaded()) {
+            std::string error;
+            std::shared_ptr<Image> image = batch->getImage(key, error);
+            if (image) {
+                onFinish(image);
+            } else {
+                onFinish(makeError(error));
+            }
+        }
+        return;
+    }
+
     for (auto p : providers) {
         if (!p->isLoaded()) {
-            p->progress();
+            p->progressExclusively();
             return;
         }
     }
@@ -574,7 +1337,9 @@ void EditedImageProvider::progress() {
         Result result = p->getResult();
         if (result.has_value()) {
             std::shared_ptr<Image> image = result.value();
-            image->usedBy.insert(key);
+            image->addUser(key);
+            if (downscale > 1)
+                image = downscaleImage(image, downscale);
             images.push_back(image);
         } else {
             onFinish(result);
@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
 
 #include "expected.hpp"
 
@@ -32,10 +33,12 @@ public:
     typedef nonstd::expected<std::shared_ptr<Image>, std::string> Result;
 
 private:
-    bool loaded;
+    std::atomic<bool> loaded;
     Result result;
 
 protected:
+    std::atomic<bool> previewRequested;
+
     void onFinish(const Result& res) {
         this->result = res;
         loaded = true;
@@ -51,7 +54,7 @@ protected:
     }
 
 public:
-    ImageProvider() : loaded(false) {
+    ImageProvider() : loaded(false), previewRequested(false) {
         LOG("create provider")
     }
 
@@ -67,6 +70,18 @@ public:
         return loaded;
     }
 
+    // a reduced version of the image that can be shown while it is loading,
+    // 'scale' being its downscaling factor
+    virtual std::shared_ptr<Image> getPreview(int& /*scale*/) const {
+        return nullptr;
+    }
+
+    // the image is the one shown by a sequence, not a prefetched one, so a preview
+    // is worth decoding if the provider hasn't started yet
+    virtual void requestPreview() {
+        previewRequested = true;
+    }
+
 };
 
 #include "ImageCache.hpp"
@@ -75,6 +90,12 @@ class CacheImageProvider : public ImageProvider {
     std::function<std::shared_ptr<ImageProvider>()> get;
     std::shared_ptr<ImageProvider> provider;
 
+    // providers of keys that are being loaded, so that two CacheImageProviders
+    // with the same key share the same underlying provider
+    static std::shared_ptr<ImageProvider> getInFlight(const std::string& key,
+                          const std::function<std::shared_ptr<ImageProvider>()>& get);
+    static void removeInFlight(const std::string& key);
+
 public:
     CacheImageProvider(const std::string& key, std::function<std::shared_ptr<ImageProvider>()> get)
         : key(key), get(get) {
@@ -83,7 +104,7 @@ public:
         } else if (ImageCache::Error::has(key)) {
             onFinish(makeError(ImageCache::Error::get(key)));
         } else {
-            provider = get();
+            provider = getInFlight(key, get);
         }
     }
 
@@ -102,7 +123,7 @@ public:
             onFinish(Result(ImageCache::get(key)));
             //printf("/!\\ inconsistent image loading\n");
         } else {
-            provider->progress();
+            provider->progressExclusively();
             if (provider->isLoaded()) {
                 Result result = provider->getResult();
                 if (result.has_value()) {
@@ -111,10 +132,33 @@ public:
                 } else {
                     ImageCache::Error::store(key, result.error());
                 }
+                removeInFlight(key);
                 onFinish(result);
             }
         }
     }
+
+    virtual void claim() {
+        ImageProvider::claim();
+        if (provider) provider->claim();
+    }
+
+    virtual void unclaim() {
+        ImageProvider::unclaim();
+        if (provider) provider->unclaim();
+    }
+
+    virtual bool isClaimed() const {
+        return ImageProvider::isClaimed() || (provider && provider->isClaimed());
+    }
+
+    virtual std::shared_ptr<Image> getPreview(int& scale) const {
+        return provider ? provider->getPreview(scale) : nullptr;
+    }
+
+    virtual void requestPreview() {
+        if (provider) provider->requestPreview();
+    }
 };
 
 class FileImageProvider : public ImageProvider {
@@ -162,15 +206,19 @@ public:
 class JPEGFileImageProvider : public FileImageProvider {
     struct jpeg_decompress_struct* cinfo;
     FILE* file;
-    float* pixels;
-    unsigned char* scanline;
+    unsigned char* pixels;
     bool error;
     struct jpeg_error_mgr* jerr;
+    // decoded at a fraction of the size before the full decoding, read from the main thread
+    std::shared_ptr<Image> preview;
+    int previewScale;
+
+    bool decodePreview();
 
 public:
     JPEGFileImageProvider(const std::string& filename)
         : FileImageProvider(filename), cinfo(nullptr), file(nullptr),
-          pixels(nullptr), scanline(nullptr), error(false), jerr(nullptr)
+          pixels(nullptr), error(false), jerr(nullptr), previewScale(0)
     {
     }
 
@@ -180,6 +228,8 @@ public:
 
     virtual void progress();
 
+    virtual std::shared_ptr<Image> getPreview(int& scale) const;
+
     void onJPEGError(const std::string& error);
 
 };
@@ -221,10 +271,12 @@ public:
 };
 
 class RAWFileImageProvider : public FileImageProvider {
+    struct RAWPrivate* p;
 
 public:
-    RAWFileImageProvider(const std::string& filename)
-        : FileImageProvider(filename)
+    // 'p' is the file already opened by open(), if any
+    RAWFileImageProvider(const std::string& filename, struct RAWPrivate* p=nullptr)
+        : FileImageProvider(filename), p(p)
     {
     }
 
@@ -234,21 +286,91 @@ public:
 
     virtual void progress();
 
-    static bool canOpen(const std::string& filename);
+    // a provider if libraw can read the file, nullptr otherwise
+    // the result is remembered until the file is modified
+    static std::shared_ptr<RAWFileImageProvider> open(const std::string& filename);
 };
 
 #include "editors.hpp"
+// consecutive frames of an edit evaluated in a single call (see OCTAVE_BATCH)
+// the providers of these frames share it and each takes its own result
+class EditBatch : public Progressable {
+    EditType edittype;
+    std::string editprog;
+    // inputs of each frame
+    std::vector<std::vector<std::shared_ptr<ImageProvider>>> providers;
+    std::vector<std::string> keys;
+    std::vector<std::shared_ptr<Image>> images;
+    std::vector<std::string> errors;
+    std::atomic<bool> loaded;
+
+public:
+    EditBatch(EditType edittype, const std::string& editprog,
+              const std::vector<std::vector<std::shared_ptr<ImageProvider>>>& providers,
+              const std::vector<std::string>& keys)
+        : edittype(edittype), editprog(editprog), providers(providers), keys(keys),
+          images(keys.size()), errors(keys.size()), loaded(false)
+    {
+    }
+
+    // the batch of this key if it is still alive, otherwise the one built by create()
+    static std::shared_ptr<EditBatch> get(const std::string& key,
+                                          const std::function<std::shared_ptr<EditBatch>()>& create);
+
+    virtual float getProgressPercentage() const;
+
+    virtual bool isLoaded() const {
+        return loaded;
+    }
+
+    virtual void progress();
+
+    // the edited image of the frame 'key', or nullptr and the error
+    std::shared_ptr<Image> getImage(const std::string& key, std::string& error) const;
+
+    virtual void claim() {
+        Progressable::claim();
+        for (auto& frame : providers)
+            for (auto p : frame) p->claim();
+    }
+
+    virtual void unclaim() {
+        Progressable::unclaim();
+        for (auto& frame : providers)
+            for (auto p : frame) p->unclaim();
+    }
+
+    virtual bool isClaimed() const {
+        if (Progressable::isClaimed()) return true;
+        for (auto& frame : providers) {
+            for (auto p : frame) {
+                if (p->isClaimed()) return true;
+            }
+        }
+        return false;
+    }
+};
+
 class EditedImageProvider : public ImageProvider {
     EditType edittype;
     std::string editprog;
     std::vector<std::shared_ptr<ImageProvider>> providers;
     std::string key; // used for usedBy
+    int downscale;
+    // when set, the frame is edited along with its neighbors and providers is empty
+    std::shared_ptr<EditBatch> batch;
 
 public:
     EditedImageProvider(EditType edittype, const std::string& editprog,
                         const std::vector<std::shared_ptr<ImageProvider>>& providers,
-                        const std::string& key)
-        : edittype(edittype), editprog(editprog), providers(providers), key(key)
+                        const std::string& key, int downscale=1)
+        : edittype(edittype), editprog(editprog), providers(providers), key(key), downscale(downscale)
+    {
+    }
+
+    EditedImageProvider(EditType edittype, const std::string& editprog,
+                        std::shared_ptr<EditBatch> batch, const std::string& key)
+        : edittype(edittype), editprog(editprog), key(key), downscale(1), batch(batch)
     {
     }
 
@@ -257,6 +379,9 @@ public:
     }
 
     virtual float getProgressPercentage() const {
+        if (batch) {
+            return batch->getProgressPercentage();
+        }
         float percent = 0.f;
         for (auto p : providers) {
             percent += p->getProgressPercentage();
@@ -266,6 +391,45 @@ public:
     }
 
     virtual void progress();
+
+    virtual void claim() {
+        ImageProvider::claim();
+        for (auto p : providers) p->claim();
+        if (batch) batch->claim();
+    }
+
+    virtual void unclaim() {
+        ImageProvider::unclaim();
+        for (auto p : providers) p->unclaim();
+        if (batch) batch->unclaim();
+    }
+
+    virtual bool isClaimed() const {
+        if (ImageProvider::isClaimed()) return true;
+        for (auto p : providers) {
+            if (p->isClaimed()) return true;
+        }
+        return batch && batch->isClaimed();
+    }
+};
+
+// the whole version of an image computed tile by tile (see TileSource::computeWhole),
+// evaluated at once and stored in the cache in place of the tiled one
+class WholeImageProvider : public ImageProvider {
+    std::shared_ptr<Image> tiled;
+    std::string key;
+
+public:
+    WholeImageProvider(std::shared_ptr<Image> tiled, const std::string& key)
+        : tiled(tiled), key(key)
+    {
+    }
+
+    virtual float getProgressPercentage() const {
+        return 0.f;
+    }
+
+    virtual void progress();
 };
 
 class VideoImageProvider : public ImageProvider {
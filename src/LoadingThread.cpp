@@ -10,13 +10,13 @@ bool LoadingThread::tick()
     // load the queue
     if (!queue.empty()) {
         std::shared_ptr<Progressable> p = queue.back();
-        p->progress();
+        p->progressExclusively();
         // if the provider is used somewhere else, refresh the screen
         // 2 because queue + local variable p
         if (p.use_count() != 2) {
             gActive = std::max(gActive, 2);
         }
-        if (p->isLoaded()) {
+        if (p->isLoaded() || p->isCancelled()) {
             queue.pop();
             LOG("i finish loading " << p);
             LOG("\n\n");
@@ -52,13 +52,13 @@ bool SleepyLoadingThread::tick()
     // load the queue
     if (!queue.empty()) {
         std::shared_ptr<Progressable> p = queue.back();
-        p->progress();
+        p->progressExclusively();
         // if the provider is used somewhere else, refresh the screen
         // 2 because queue + local variable p
         if (p.use_count() != 2) {
             gActive = std::max(gActive, 2);
         }
-        if (p->isLoaded()) {
+        if (p->isLoaded() || p->isCancelled()) {
             queue.pop();
         }
     }
@@ -88,3 +88,50 @@ void SleepyLoadingThread::run()
     }
 }
 
+
+std::shared_ptr<Progressable> SleepyLoadingThreadPool::take()
+{
+    std::lock_guard<std::mutex> _lock(getnewLock);
+    std::shared_ptr<Progressable> p = getnew();
+    if (p) {
+        p->claim();
+    }
+    return p;
+}
+
+void SleepyLoadingThreadPool::run()
+{
+    std::shared_ptr<Progressable> p;
+    while (running) {
+        if (p && p->isCancelled()) {
+            p->unclaim();
+            p = nullptr;
+        }
+        if (p) {
+            p->progressExclusively();
+            // if the provider is used somewhere else, refresh the screen
+            if (p.use_count() != 1) {
+                gActive = std::max(gActive, 2);
+            }
+            if (p->isLoaded()) {
+                p->unclaim();
+                p = nullptr;
+            }
+            continue;
+        }
+
+        uint64_t gen;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            gen = generation;
+        }
+
+        p = take();
+        if (!p) {
+            gIdleLoaders++;
+            std::unique_lock<std::mutex> lk(m);
+            cv.wait(lk, [this,gen]{ return generation != gen; });
+            gIdleLoaders--;
+        }
+    }
+}
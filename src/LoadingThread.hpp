@@ -4,6 +4,8 @@
 #include <queue>
 #include <memory>
 #include <functional>
+#include <algorithm>
+#include <cstdint>
 
 class Progressable;
 
@@ -83,3 +85,56 @@ public:
 };
 
 
+
+#include <vector>
+
+// several SleepyLoadingThreads sharing the same source of jobs
+// getnew() is called by one worker at a time and the returned job is claimed
+// before the next call, so getnew() can skip claimed jobs
+class SleepyLoadingThreadPool {
+    bool running;
+    std::vector<std::thread> threads;
+    std::function<std::shared_ptr<Progressable>()> getnew;
+    std::mutex getnewLock;
+    std::mutex m;
+    std::condition_variable cv;
+    uint64_t generation;
+
+    std::shared_ptr<Progressable> take();
+
+    void run();
+
+public:
+
+    SleepyLoadingThreadPool(std::function<std::shared_ptr<Progressable>()> getnew)
+        : running(false), getnew(getnew), generation(0) {
+    }
+
+    void start(size_t numthreads) {
+        running = true;
+        for (size_t i = 0; i < std::max(numthreads, (size_t) 1); i++) {
+            threads.push_back(std::thread(&SleepyLoadingThreadPool::run, this));
+        }
+    }
+
+    void stop() {
+        running = false;
+        notify();
+    }
+
+    void join() {
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void notify() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            generation++;
+        }
+        cv.notify_all();
+    }
+
+};
+
@@ -0,0 +1,227 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Prefetcher.hpp"
+#include "Sequence.hpp"
+#include "Player.hpp"
+#include "Window.hpp"
+#include "Image.hpp"
+#include "ImageCache.hpp"
+#include "ImageProvider.hpp"
+#include "ImageCollection.hpp"
+#include "globals.hpp"
+#include "events.hpp"
+
+#define MIN_DEPTH 8
+#define MAX_DEPTH 100
+
+namespace Prefetcher {
+
+    struct Job {
+        std::string key;
+        ImageCollection* collection;
+        int index;
+        int priority;
+        // created by the loading threads the first time the job is picked
+        std::shared_ptr<ImageProvider> provider;
+        uint64_t started;
+    };
+
+    // sorted by priority, lower first
+    static std::vector<Job> jobs;
+    static std::mutex lock;
+    // moving average of the time needed to load a frame, in milliseconds
+    static double decodeTime = 30.;
+
+    // frames that the player will show next, in order, following the direction
+    // of the playback and the bounds
+    static std::vector<int> upcomingFrames(const Player* player, int depth)
+    {
+        std::vector<int> frames;
+        int min = player->currentMinFrame;
+        int max = player->currentMaxFrame;
+        int d = (player->fps >= 0 ? 1 : -1) * (player->bouncy ? player->direction : 1);
+        int frame = player->frame;
+        while ((int) frames.size() < depth) {
+            frame += d;
+            if (player->bouncy) {
+                if (frame < min) {
+                    frame = min + 1;
+                    d *= -1;
+                }
+                if (frame > max) {
+                    frame = max - 1;
+                    d *= -1;
+                }
+            }
+            if (frame > max) {
+                if (!player->looping) break;
+                frame = min;
+            }
+            if (frame < min) {
+                if (!player->looping) break;
+                frame = max;
+            }
+            if (frame == player->frame
+                || std::find(frames.begin(), frames.end(), frame) != frames.end()) {
+                break;
+            }
+            frames.push_back(frame);
+        }
+        return frames;
+    }
+
+    // enough frames to cover the loading time at the current framerate,
+    // but not so many that they would evict each other from the cache
+    static int computeDepth(const Player* player, const std::vector<Sequence*>& sequences)
+    {
+        int depth = MIN_DEPTH;
+        if (player->playing) {
+            depth += 2 * std::ceil(std::abs(player->fps) * decodeTime / 1000.);
+        }
+
+        size_t bytesPerFrame = 0;
+        for (auto seq : sequences) {
+            if (seq->image) {
+                bytesPerFrame += seq->image->getSizeInBytes();
+            }
+        }
+        if (bytesPerFrame) {
+            size_t limit = gCacheLimitMB*1000000 / 2;
+            depth = std::min(depth, (int) (limit / bytesPerFrame));
+        }
+        return std::max(0, std::min(depth, MAX_DEPTH));
+    }
+
+    static bool isVisible(const Sequence* seq)
+    {
+        for (auto win : gWindows) {
+            if (win->opened && win->getCurrentSequence() == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool update()
+    {
+        std::vector<Job> newjobs;
+        if (gPreload) {
+            std::unordered_set<std::string> keys;
+            for (auto player : gPlayers) {
+                std::vector<Sequence*> sequences;
+                for (auto seq : gSequences) {
+                    // previews are replaced as soon as the edit is validated
+                    if (seq->player == player && seq->valid && seq->collection
+                        && seq->collection->getLength() > 0 && seq->previewScale == 1) {
+                        sequences.push_back(seq);
+                    }
+                }
+                if (sequences.empty())
+                    continue;
+
+                std::vector<int> frames = upcomingFrames(player, computeDepth(player, sequences));
+                for (size_t i = 0; i < frames.size(); i++) {
+                    for (auto seq : sequences) {
+                        ImageCollection* collection = seq->collection;
+                        int index = std::min(frames[i], collection->getLength()) - 1;
+                        std::string key = collection->getKey(index);
+                        if (keys.count(key) || ImageCache::has(key) || ImageCache::Error::has(key))
+                            continue;
+                        keys.insert(key);
+
+                        // hidden sequences come after all the visible ones
+                        int priority = i + (isVisible(seq) ? 0 : frames.size());
+                        newjobs.push_back(Job{key, collection, index, priority, nullptr, 0});
+                    }
+                }
+            }
+            std::stable_sort(newjobs.begin(), newjobs.end(),
+                             [](const Job& a, const Job& b) { return a.priority < b.priority; });
+        }
+
+        std::lock_guard<std::mutex> _lock(lock);
+        std::unordered_map<std::string, Job*> previous;
+        for (auto& job : jobs) {
+            if (job.provider && job.provider->isLoaded() && job.started) {
+                decodeTime = 0.9 * decodeTime + 0.1 * letTimeFlow(&job.started);
+                job.started = 0;
+            }
+            previous[job.key] = &job;
+        }
+        // keep the providers that are still needed
+        for (auto& job : newjobs) {
+            auto i = previous.find(job.key);
+            if (i != previous.end() && i->second->collection == job.collection) {
+                job.provider = i->second->provider;
+                job.started = i->second->started;
+                i->second->provider = nullptr;
+            }
+        }
+        // and cancel the ones that fell out of the window
+        for (auto& job : jobs) {
+            if (job.provider) {
+                job.provider->cancel();
+            }
+        }
+        jobs.swap(newjobs);
+
+        for (auto& job : jobs) {
+            if (!job.provider || (!job.provider->isLoaded() && !job.provider->isClaimed())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::shared_ptr<ImageProvider> getNext()
+    {
+        std::unique_lock<std::mutex> _lock(lock);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (!jobs[i].provider) {
+                // creating a provider can touch the disk, don't block update() meanwhile
+                std::string key = jobs[i].key;
+                ImageCollection* collection = jobs[i].collection;
+                int index = jobs[i].index;
+                _lock.unlock();
+                std::shared_ptr<ImageProvider> provider = collection->getImageProvider(index);
+                _lock.lock();
+
+                if (i >= jobs.size() || jobs[i].key != key) {
+                    // update() replaced the jobs in the meantime
+                    if (provider->isLoaded() || provider->isClaimed())
+                        return nullptr;
+                    return provider;
+                }
+                jobs[i].provider = provider;
+            }
+
+            Job& job = jobs[i];
+            if (job.provider->isLoaded() || job.provider->isClaimed())
+                continue;
+            if (!job.started) {
+                letTimeFlow(&job.started);
+            }
+            return job.provider;
+        }
+        return nullptr;
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        for (auto& job : jobs) {
+            if (job.provider) {
+                job.provider->cancel();
+            }
+        }
+        jobs.clear();
+    }
+
+}
+
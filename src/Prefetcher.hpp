@@ -0,0 +1,20 @@
+#pragma once
+
+#include <memory>
+
+class ImageProvider;
+
+// plans which frames should be loaded ahead of the players
+namespace Prefetcher {
+
+    // recompute the frames to prefetch, from the UI thread
+    // returns true if some frames are waiting for a loading thread
+    bool update();
+
+    // next provider to progress, from the loading threads
+    std::shared_ptr<ImageProvider> getNext();
+
+    void flush();
+
+}
+
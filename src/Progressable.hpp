@@ -1,9 +1,53 @@
 #pragma once
 
+#include <mutex>
+#include <atomic>
+
 class Progressable {
+    std::mutex progressLock;
+    std::atomic<int> claims;
+    std::atomic<bool> cancelled;
+
 public:
+    Progressable() : claims(0), cancelled(false) {
+    }
+
+    virtual ~Progressable() {
+    }
+
     virtual float getProgressPercentage() const = 0;
     virtual bool isLoaded() const = 0;
     virtual void progress() = 0;
+
+    // progress() but never from two threads at the same time
+    void progressExclusively() {
+        std::lock_guard<std::mutex> _lock(progressLock);
+        if (!isLoaded() && !isCancelled()) {
+            progress();
+        }
+    }
+
+    // ask the loading threads to stop progressing this object
+    // the partial results are freed when the last reference is dropped
+    virtual void cancel() {
+        cancelled = true;
+    }
+
+    bool isCancelled() const {
+        return cancelled;
+    }
+
+    // a claimed object is being worked on by a loading thread
+    virtual void claim() {
+        claims++;
+    }
+
+    virtual void unclaim() {
+        claims--;
+    }
+
+    virtual bool isClaimed() const {
+        return claims > 0;
+    }
 };
 
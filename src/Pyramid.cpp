@@ -0,0 +1,337 @@
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Image.hpp"
+#include "ImageCache.hpp"
+#include "globals.hpp"
+#include "Pyramid.hpp"
+#include "parallel.hpp"
+
+// rows of a level built by each call to progress()
+#define ROWS_PER_STEP 512
+// rows given to each thread of the pool
+#define ROWS_PER_THREAD 32
+// levels stop when the image fits in this size
+#define MIN_LEVEL_SIZE 64
+
+static std::string getKey(const Image& image, int level)
+{
+    return image.ID + " level " + std::to_string(level);
+}
+
+Pyramid::Pyramid()
+    : requested(0), loaded(true), curlevel(0), curh(0), w(0), h(0), buffer(nullptr)
+{
+}
+
+Pyramid::~Pyramid()
+{
+    free(buffer);
+}
+
+void Pyramid::request(const std::shared_ptr<Image>& image, int level)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    this->image = image;
+    requested = std::max((int) requested, std::min(level, getMaxLevel(*image)));
+    // a level might have been evicted, progress() finds out which ones are missing
+    loaded = false;
+}
+
+std::shared_ptr<Image> Pyramid::getLevel(const Image& image, int level) const
+{
+    if (level == 0)
+        return nullptr;
+    return ImageCache::get(getKey(image, level));
+}
+
+int Pyramid::getMaxLevel(const Image& image)
+{
+    int level = 0;
+    size_t size = std::max(image.w, image.h);
+    while (size > MIN_LEVEL_SIZE) {
+        size = (size + 1) / 2;
+        level++;
+    }
+    return level;
+}
+
+float Pyramid::getProgressPercentage() const
+{
+    if (loaded) return 1.f;
+    if (!h) return 0.f;
+    return (float) curh / h;
+}
+
+template <typename T>
+static void storeRow(const float* values, size_t n, T* row)
+{
+    for (size_t i = 0; i < n; i++) {
+        row[i] = values[i] + .5f;
+    }
+}
+
+template <>
+void storeRow(const float* values, size_t n, float* row)
+{
+    std::copy(values, values + n, row);
+}
+
+// halve one row pair into 'out'
+// multiscale qualities average 2x2 blocks, the others keep one pixel out of 4 like a nearest neighbor
+static void downscaleRows(const float* a, const float* b, size_t sw, size_t c, size_t w, float* out)
+{
+    if (gDownsamplingQuality >= 2) {
+        for (size_t x = 0; x < w; x++) {
+            size_t x0 = 2 * x * c;
+            size_t x1 = std::min(2 * x + 1, sw - 1) * c;
+            for (size_t d = 0; d < c; d++) {
+                out[x * c + d] = .25f * (a[x0 + d] + a[x1 + d] + b[x0 + d] + b[x1 + d]);
+            }
+        }
+    } else {
+        for (size_t x = 0; x < w; x++) {
+            for (size_t d = 0; d < c; d++) {
+                out[x * c + d] = a[2 * x * c + d];
+            }
+        }
+    }
+}
+
+// averages of 2x2 blocks on the native samples
+// the integers are rounded like storeRow() rounds the float averages
+static inline uint8_t average(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    return (a + b + c + d + 2) >> 2;
+}
+
+static inline uint16_t average(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+{
+    return (a + b + c + d + 2) >> 2;
+}
+
+static inline float average(float a, float b, float c, float d)
+{
+    return .25f * (a + b + c + d);
+}
+
+// same as downscaleRows() followed by storeRow(), for the rows [y0, y1) of the level
+// working on the samples in memory avoids converting the whole source to float
+template <typename T>
+static void downscaleImageRows(const T* src, size_t sw, size_t sh, size_t c,
+                               size_t w, size_t y0, size_t y1, T* dst)
+{
+    for (size_t y = y0; y < y1; y++) {
+        const T* a = src + 2 * y * sw * c;
+        const T* b = src + std::min(2 * y + 1, sh - 1) * sw * c;
+        T* out = dst + y * w * c;
+        if (gDownsamplingQuality >= 2) {
+            // an odd width repeats the last column
+            size_t full = sw / 2;
+            for (size_t x = 0; x < full; x++) {
+                const T* a0 = a + 2 * x * c;
+                const T* b0 = b + 2 * x * c;
+                for (size_t d = 0; d < c; d++) {
+                    out[x * c + d] = average(a0[d], a0[c + d], b0[d], b0[c + d]);
+                }
+            }
+            for (size_t x = full; x < w; x++) {
+                const T* a0 = a + 2 * x * c;
+                const T* b0 = b + 2 * x * c;
+                for (size_t d = 0; d < c; d++) {
+                    out[x * c + d] = average(a0[d], a0[d], b0[d], b0[d]);
+                }
+            }
+        } else {
+            for (size_t x = 0; x < w; x++) {
+                for (size_t d = 0; d < c; d++) {
+                    out[x * c + d] = a[2 * x * c + d];
+                }
+            }
+        }
+    }
+}
+
+// a level of a tiled image without overviews, each tile being reduced from the 2x2 tiles
+// of the previous level when the view asks for it, on the loading threads
+struct ReducedTileSource : TileSource {
+    // tiles of the previous level, cached under its ID
+    std::shared_ptr<TileSource> source;
+    std::string sourceID;
+    size_t sw, sh;
+    size_t w, h, c;
+    SampleType type;
+
+    ReducedTileSource(const Image& previous)
+        : TileSource(previous.tiles->tilew, previous.tiles->tileh), source(previous.tiles),
+          sourceID(previous.ID), sw(previous.w), sh(previous.h),
+          w((previous.w + 1) / 2), h((previous.h + 1) / 2), c(previous.c), type(previous.type) {
+    }
+
+    std::shared_ptr<Image> readTile(size_t tx, size_t ty) {
+        size_t x = tx * tilew;
+        size_t y = ty * tileh;
+        if (x >= w || y >= h)
+            return nullptr;
+        size_t cw = std::min(tilew, w - x);
+        size_t ch = std::min(tileh, h - y);
+
+        // the four tiles of the previous level, those outside of it stay null
+        std::shared_ptr<Image> quads[4];
+        std::atomic<bool> ok(true);
+        parallel_for(4, parallel_chunks(4, 1), [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                size_t qx = 2 * tx + i % 2;
+                size_t qy = 2 * ty + i / 2;
+                if (qx * tilew >= sw || qy * tileh >= sh)
+                    continue;
+                quads[i] = getCachedTile(sourceID, *source, qx, qy);
+                if (!quads[i])
+                    ok = false;
+            }
+        });
+        if (!ok)
+            return nullptr;
+
+        // the area of the previous level covered by the tile
+        size_t aw = std::min(2 * cw, sw - 2 * x);
+        size_t ah = std::min(2 * ch, sh - 2 * y);
+        std::vector<float> area(aw * ah * c);
+        for (size_t i = 0; i < 4; i++) {
+            const std::shared_ptr<Image>& quad = quads[i];
+            if (!quad)
+                continue;
+            size_t qx0 = (i % 2) * tilew;
+            size_t qy0 = (i / 2) * tileh;
+            for (size_t r = 0; r < quad->h && qy0 + r < ah; r++) {
+                size_t n = std::min(quad->w, aw - qx0) * c;
+                quad->getSamples(r * quad->w * c, n, 1, &area[((qy0 + r) * aw + qx0) * c]);
+            }
+        }
+
+        void* pixels = malloc(cw * ch * c * getSampleSize(type));
+        std::vector<float> out(cw * c);
+        for (size_t r = 0; r < ch; r++) {
+            const float* a = &area[2 * r * aw * c];
+            const float* b = &area[std::min(2 * r + 1, ah - 1) * aw * c];
+            downscaleRows(a, b, aw, c, cw, out.data());
+            size_t offset = r * cw * c;
+            switch (type) {
+                case SAMPLE_UINT8:
+                    storeRow(out.data(), out.size(), (uint8_t*) pixels + offset);
+                    break;
+                case SAMPLE_UINT16:
+                    storeRow(out.data(), out.size(), (uint16_t*) pixels + offset);
+                    break;
+                case SAMPLE_FLOAT32:
+                    storeRow(out.data(), out.size(), (float*) pixels + offset);
+                    break;
+            }
+        }
+        return std::make_shared<Image>(pixels, cw, ch, c, type);
+    }
+};
+
+void Pyramid::finishLevel(const std::shared_ptr<Image>& image)
+{
+    auto level = std::make_shared<Image>(buffer, w, h, source->c, source->type);
+    buffer = nullptr;
+    source = nullptr;
+    std::string key = getKey(*image, curlevel);
+    ImageCache::store(key, level);
+    if (!ImageCache::has(key)) {
+        // the cache is too small, don't try to build the next levels again and again
+        std::lock_guard<std::mutex> _lock(lock);
+        requested = curlevel - 1;
+    }
+}
+
+void Pyramid::progress()
+{
+    std::shared_ptr<Image> image;
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        image = this->image.lock();
+    }
+    if (!image) {
+        loaded = true;
+        return;
+    }
+
+    // tiled images get tiled levels, read on demand like the image: from the overviews
+    // of the format if it has some, else reduced tile by tile from the previous level
+    if (!source && image->tiles) {
+        std::shared_ptr<Image> previous = image;
+        size_t lw = image->w;
+        size_t lh = image->h;
+        for (int level = 1; level <= requested; level++) {
+            lw = (lw + 1) / 2;
+            lh = (lh + 1) / 2;
+            std::shared_ptr<Image> l = getLevel(*image, level);
+            if (!l) {
+                std::shared_ptr<TileSource> tiles = image->tiles->getLevel(level);
+                if (!tiles)
+                    tiles = std::make_shared<ReducedTileSource>(*previous);
+                l = std::make_shared<Image>(tiles, lw, lh, *image);
+                ImageCache::store(getKey(*image, level), l);
+            }
+            previous = l;
+        }
+        loaded = true;
+        return;
+    }
+
+    if (!source) {
+        // start from the first missing level, the previous one being the source
+        int level = 1;
+        std::shared_ptr<Image> previous = image;
+        while (level <= requested) {
+            std::shared_ptr<Image> l = getLevel(*image, level);
+            if (!l) break;
+            previous = l;
+            level++;
+        }
+        if (level > requested) {
+            loaded = true;
+            return;
+        }
+        source = previous;
+        curlevel = level;
+        curh = 0;
+        w = (source->w + 1) / 2;
+        h = (source->h + 1) / 2;
+        buffer = malloc(w * h * source->c * getSampleSize(source->type));
+    }
+
+    // the levels of the images in memory are in memory too
+    size_t end = std::min(h, curh + ROWS_PER_STEP);
+    size_t first = curh;
+    parallel_for(end - first, parallel_chunks(end - first, ROWS_PER_THREAD),
+                 [&](size_t, size_t begin, size_t stop) {
+        size_t sw = source->w;
+        size_t sh = source->h;
+        size_t c = source->c;
+        switch (source->type) {
+            case SAMPLE_UINT8:
+                downscaleImageRows((const uint8_t*) source->pixels, sw, sh, c, w,
+                                   first + begin, first + stop, (uint8_t*) buffer);
+                break;
+            case SAMPLE_UINT16:
+                downscaleImageRows((const uint16_t*) source->pixels, sw, sh, c, w,
+                                   first + begin, first + stop, (uint16_t*) buffer);
+                break;
+            case SAMPLE_FLOAT32:
+                downscaleImageRows((const float*) source->pixels, sw, sh, c, w,
+                                   first + begin, first + stop, (float*) buffer);
+                break;
+        }
+    });
+    curh = end;
+
+    if (curh == h) {
+        finishLevel(image);
+    }
+}
+
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+#include "Progressable.hpp"
+
+struct Image;
+
+// downscaled versions of an image, each level being half the size of the previous one
+// the levels are built on the compute thread and kept in the ImageCache
+class Pyramid : public Progressable {
+    std::mutex lock;
+    std::weak_ptr<Image> image;
+    std::atomic<int> requested;
+    std::atomic<bool> loaded;
+
+    // level being built, only used by progress()
+    std::shared_ptr<Image> source;
+    int curlevel;
+    size_t curh;
+    size_t w, h;
+    void* buffer;
+
+    void finishLevel(const std::shared_ptr<Image>& image);
+
+public:
+    Pyramid();
+    ~Pyramid();
+
+    // ask for the levels 1 to 'level' to be built
+    void request(const std::shared_ptr<Image>& image, int level);
+
+    // coarsest level asked so far, 0 if the image was never shown zoomed out
+    int getRequestedLevel() const {
+        return requested;
+    }
+
+    // nullptr if the level is not built yet (or was evicted from the cache)
+    std::shared_ptr<Image> getLevel(const Image& image, int level) const;
+
+    // coarsest useful level, smaller levels are not worth it
+    static int getMaxLevel(const Image& image);
+
+    float getProgressPercentage() const;
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void progress();
+};
+
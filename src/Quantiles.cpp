@@ -0,0 +1,365 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <list>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+
+#include "Quantiles.hpp"
+#include "parallel.hpp"
+
+// the histogram finds the bins of the quantiles, then the samples of these bins are
+// scanned again so that the values are exact, even if one outlier squeezes all the others in a bin
+#define QUANTILE_BINS (1 << 16)
+// a bin with more samples than this is split by another pass instead of being gathered,
+// at most MAX_REFINEMENTS times
+#define MAX_GATHERED_SAMPLES (1 << 20)
+#define REFINE_BINS (1 << 12)
+#define MAX_REFINEMENTS 8
+#define MAX_DISTRIBUTIONS 16
+// a thread is not worth it for less than this
+#define SAMPLES_PER_THREAD (1 << 18)
+
+namespace Quantiles {
+
+    struct Distribution {
+        float min, max;
+        float f;
+        // number of finite samples in the bins [0, b]
+        std::vector<uint64_t> cumulative;
+        // exact values of the ranks already asked
+        std::mutex lock;
+        std::unordered_map<uint64_t, float> values;
+    };
+
+    // most recently used first
+    static std::list<std::pair<std::string, std::shared_ptr<Distribution>>> distributions;
+    static std::mutex lock;
+
+    static std::string getKey(const Image& image, ImRect region, const std::vector<size_t>& bands)
+    {
+        std::string key = image.ID;
+        key += " " + std::to_string((int) region.Min.x) + "," + std::to_string((int) region.Min.y);
+        key += " " + std::to_string((int) region.Max.x) + "," + std::to_string((int) region.Max.y);
+        for (size_t b : bands) {
+            key += " " + std::to_string(b);
+        }
+        return key;
+    }
+
+    static int getBin(float v, float min, float f)
+    {
+        int bin = (v - min) * f;
+        return std::max(0, std::min(bin, QUANTILE_BINS - 1));
+    }
+
+    // calls fn(t, y0, y1) on bands of rows of the region, from nthreads threads of the shared pool
+    // returns nthreads, which is at most hardware_concurrency()
+    static size_t forEachRows(ImRect region, size_t nbands,
+                              const std::function<void(size_t, size_t, size_t)>& fn)
+    {
+        size_t y0 = region.Min.y;
+        size_t rows = region.Max.y - y0;
+        size_t rowsamples = std::max((size_t) 1, (size_t) region.GetWidth() * nbands);
+        size_t nthreads = parallel_chunks(rows, SAMPLES_PER_THREAD / rowsamples);
+        parallel_for(rows, nthreads, [&](size_t t, size_t start, size_t end) {
+            fn(t, y0 + start, y0 + end);
+        });
+        return nthreads;
+    }
+
+    // calls fn(v) on each finite sample of the rows [y0, y1) of the region
+    template <typename F>
+    static void forEachSample(const Image& image, ImRect region, const std::vector<size_t>& bands,
+                              size_t y0, size_t y1, F fn)
+    {
+        size_t c = image.c;
+        size_t minx = region.Min.x;
+        size_t w = region.GetWidth();
+        std::vector<float> row(w * c);
+        for (size_t y = y0; y < y1; y++) {
+            image.getSamples((y * image.w + minx) * c, row.size(), 1, row.data());
+            for (size_t x = 0; x < w; x++) {
+                for (size_t b : bands) {
+                    float v = row[x * c + b];
+                    if (std::isfinite(v)) {
+                        fn(v);
+                    }
+                }
+            }
+        }
+    }
+
+    static std::shared_ptr<Distribution> compute(const Image& image, ImRect region,
+                                                 const std::vector<size_t>& bands)
+    {
+        auto dist = std::make_shared<Distribution>();
+        // the range of the whole image bounds the range of any region
+        dist->min = std::numeric_limits<float>::max();
+        dist->max = std::numeric_limits<float>::lowest();
+        for (size_t b : bands) {
+            dist->min = std::min(dist->min, image.stats.bandmin[b]);
+            dist->max = std::max(dist->max, image.stats.bandmax[b]);
+        }
+        if (dist->min > dist->max) {
+            return dist;
+        }
+        float min = dist->min;
+        float f = dist->max > dist->min ? (QUANTILE_BINS - 1) / (dist->max - dist->min) : 0.f;
+        dist->f = f;
+
+        size_t maxthreads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::vector<uint64_t>> bins(maxthreads);
+        size_t nthreads = forEachRows(region, bands.size(), [&](size_t t, size_t y0, size_t y1) {
+            bins[t].resize(QUANTILE_BINS);
+            forEachSample(image, region, bands, y0, y1, [&](float v) {
+                bins[t][getBin(v, min, f)]++;
+            });
+        });
+
+        dist->cumulative.resize(QUANTILE_BINS);
+        uint64_t total = 0;
+        for (int b = 0; b < QUANTILE_BINS; b++) {
+            for (size_t t = 0; t < nthreads; t++) {
+                total += bins[t][b];
+            }
+            dist->cumulative[b] = total;
+        }
+        return dist;
+    }
+
+    // the samples of a bin of the histogram, narrowed down to [lo, hi] by the next passes
+    struct Cell {
+        int bin;
+        bool refined;
+        float lo, hi;
+        // number of samples in the cell, and rank of the wanted one among them
+        uint64_t count;
+        uint64_t rank;
+
+        bool contains(float v, const Distribution& dist) const {
+            if (refined)
+                return lo <= v && v <= hi;
+            return getBin(v, dist.min, dist.f) == bin;
+        }
+
+        // mapping (v - min) * f of the samples of the cell to REFINE_BINS bins
+        // in double, as the range of the whole image can overflow a float
+        void getMapping(const Distribution& dist, double& min, double& f) const {
+            if (refined) {
+                min = lo;
+                f = (REFINE_BINS - 1) / ((double) hi - lo);
+            } else if (dist.f > 0) {
+                min = dist.min + bin / (double) dist.f;
+                f = dist.f * (double) REFINE_BINS;
+            } else {
+                // one bin holds everything, the image is constant or its range overflowed
+                min = dist.min;
+                f = dist.max > dist.min ? (REFINE_BINS - 1) / ((double) dist.max - dist.min) : 0.;
+            }
+        }
+    };
+
+    static int getRefinedBin(float v, double min, double f)
+    {
+        double bin = (v - min) * f;
+        return std::max(0, std::min((int) bin, REFINE_BINS - 1));
+    }
+
+    // exact values of the samples of ranks 'ranks'
+    // while the bins of the ranks hold too many samples to be gathered, they are split
+    // by another histogram, whose bins are narrowed to the extreme samples they hold
+    static void getValuesAt(const Image& image, ImRect region, const std::vector<size_t>& bands,
+                            Distribution& dist, const uint64_t ranks[2], float values[2])
+    {
+        std::lock_guard<std::mutex> _lock(dist.lock);
+        auto found0 = dist.values.find(ranks[0]);
+        auto found1 = dist.values.find(ranks[1]);
+        if (found0 != dist.values.end() && found1 != dist.values.end()) {
+            values[0] = found0->second;
+            values[1] = found1->second;
+            return;
+        }
+
+        const auto& cumulative = dist.cumulative;
+        Cell cells[2];
+        bool done[2] = {false, false};
+        for (int i = 0; i < 2; i++) {
+            int bin = std::upper_bound(cumulative.begin(), cumulative.end(), ranks[i]) - cumulative.begin();
+            bin = std::min(bin, QUANTILE_BINS - 1);
+            uint64_t before = bin ? cumulative[bin - 1] : 0;
+            cells[i] = Cell{bin, false, 0.f, 0.f, cumulative[bin] - before, ranks[i] - before};
+        }
+
+        size_t maxthreads = std::max(1u, std::thread::hardware_concurrency());
+        for (int pass = 0; pass < MAX_REFINEMENTS; pass++) {
+            bool refine[2];
+            double mins[2], fs[2];
+            for (int i = 0; i < 2; i++) {
+                refine[i] = !done[i] && cells[i].count > MAX_GATHERED_SAMPLES;
+                cells[i].getMapping(dist, mins[i], fs[i]);
+            }
+            if (!refine[0] && !refine[1])
+                break;
+
+            // per thread: count, smallest and largest sample of each bin
+            struct Bins {
+                std::vector<uint64_t> count;
+                std::vector<float> lo, hi;
+            };
+            std::vector<Bins> bins[2] = {std::vector<Bins>(maxthreads), std::vector<Bins>(maxthreads)};
+            size_t nthreads = forEachRows(region, bands.size(), [&](size_t t, size_t y0, size_t y1) {
+                for (int i = 0; i < 2; i++) {
+                    if (!refine[i]) continue;
+                    bins[i][t].count.assign(REFINE_BINS, 0);
+                    bins[i][t].lo.assign(REFINE_BINS, std::numeric_limits<float>::max());
+                    bins[i][t].hi.assign(REFINE_BINS, std::numeric_limits<float>::lowest());
+                }
+                forEachSample(image, region, bands, y0, y1, [&](float v) {
+                    for (int i = 0; i < 2; i++) {
+                        if (refine[i] && cells[i].contains(v, dist)) {
+                            Bins& b = bins[i][t];
+                            int bin = getRefinedBin(v, mins[i], fs[i]);
+                            b.count[bin]++;
+                            b.lo[bin] = std::min(b.lo[bin], v);
+                            b.hi[bin] = std::max(b.hi[bin], v);
+                        }
+                    }
+                });
+            });
+
+            for (int i = 0; i < 2; i++) {
+                if (!refine[i])
+                    continue;
+                // the mapping is monotonic, the samples of the previous bins are all below lo
+                uint64_t before = 0;
+                uint64_t count = 0;
+                int bin = 0;
+                for (; bin < REFINE_BINS; bin++) {
+                    count = 0;
+                    for (size_t t = 0; t < nthreads; t++) {
+                        count += bins[i][t].count[bin];
+                    }
+                    if (before + count > cells[i].rank)
+                        break;
+                    before += count;
+                }
+                if (bin == REFINE_BINS) {
+                    // the image changed since the histogram was computed
+                    values[i] = (float) mins[i];
+                    done[i] = true;
+                    continue;
+                }
+                Cell& cell = cells[i];
+                cell.refined = true;
+                cell.lo = std::numeric_limits<float>::max();
+                cell.hi = std::numeric_limits<float>::lowest();
+                for (size_t t = 0; t < nthreads; t++) {
+                    cell.lo = std::min(cell.lo, bins[i][t].lo[bin]);
+                    cell.hi = std::max(cell.hi, bins[i][t].hi[bin]);
+                }
+                cell.count = count;
+                cell.rank -= before;
+                if (cell.lo == cell.hi) {
+                    values[i] = cell.lo;
+                    done[i] = true;
+                }
+            }
+        }
+
+        if (!done[0] || !done[1]) {
+            std::vector<std::vector<float>> samples0(maxthreads);
+            std::vector<std::vector<float>> samples1(maxthreads);
+            size_t nthreads = forEachRows(region, bands.size(), [&](size_t t, size_t y0, size_t y1) {
+                forEachSample(image, region, bands, y0, y1, [&](float v) {
+                    if (!done[0] && cells[0].contains(v, dist)) {
+                        samples0[t].push_back(v);
+                    }
+                    if (!done[1] && cells[1].contains(v, dist)) {
+                        samples1[t].push_back(v);
+                    }
+                });
+            });
+
+            std::vector<float> samples[2];
+            for (size_t t = 0; t < nthreads; t++) {
+                samples[0].insert(samples[0].end(), samples0[t].begin(), samples0[t].end());
+                samples[1].insert(samples[1].end(), samples1[t].begin(), samples1[t].end());
+            }
+            for (int i = 0; i < 2; i++) {
+                if (done[i])
+                    continue;
+                std::vector<float>& s = samples[i];
+                if (s.empty()) {
+                    // the image changed since the histogram was computed
+                    double min, f;
+                    cells[i].getMapping(dist, min, f);
+                    values[i] = min;
+                    continue;
+                }
+                size_t k = std::min<size_t>(cells[i].rank, s.size() - 1);
+                std::nth_element(s.begin(), s.begin() + k, s.end());
+                values[i] = s[k];
+            }
+        }
+
+        for (int i = 0; i < 2; i++) {
+            dist.values[ranks[i]] = values[i];
+        }
+    }
+
+    bool get(const std::shared_ptr<Image>& image, ImRect region, BandIndices bands,
+             float quantile, float& low, float& high)
+    {
+        std::vector<size_t> used;
+        for (size_t b : bands) {
+            if (b < image->c && std::find(used.begin(), used.end(), b) == used.end()) {
+                used.push_back(b);
+            }
+        }
+        if (used.empty())
+            return false;
+
+        std::string key = getKey(*image, region, used);
+        std::shared_ptr<Distribution> dist;
+        {
+            std::lock_guard<std::mutex> _lock(lock);
+            for (auto it = distributions.begin(); it != distributions.end(); it++) {
+                if (it->first == key) {
+                    dist = it->second;
+                    distributions.splice(distributions.begin(), distributions, it);
+                    break;
+                }
+            }
+        }
+
+        if (!dist) {
+            dist = compute(*image, region, used);
+            std::lock_guard<std::mutex> _lock(lock);
+            distributions.emplace_front(key, dist);
+            if (distributions.size() > MAX_DISTRIBUTIONS) {
+                distributions.pop_back();
+            }
+        }
+
+        if (dist->cumulative.empty() || !dist->cumulative.back())
+            return false;
+
+        uint64_t total = dist->cumulative.back();
+        uint64_t ranks[2] = {
+            std::min<uint64_t>(quantile * total, total - 1),
+            std::min<uint64_t>((1 - quantile) * total, total - 1),
+        };
+        float values[2];
+        getValuesAt(*image, region, used, *dist, ranks, values);
+        low = values[0];
+        high = values[1];
+        return true;
+    }
+
+}
+
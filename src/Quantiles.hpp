@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+
+#include "imgui.h"
+#define IMGUI_DEFINE_MATH_OPERATORS
+#include "imgui_internal.h"
+
+#include "Image.hpp"
+
+// quantiles of the finite samples of an image, without sorting all of them
+// the distribution of each (image, region, bands) is kept so that asking for other quantiles is free
+namespace Quantiles {
+
+    // values at the ranks 'quantile' and '1-quantile', in the region and the given bands
+    // returns false if there is no finite sample
+    bool get(const std::shared_ptr<Image>& image, ImRect region, BandIndices bands,
+             float quantile, float& low, float& high);
+
+}
+
@@ -12,6 +12,9 @@
 #include <sys/stat.h> // stat
 
 #include "Sequence.hpp"
+#include "Quantiles.hpp"
+#include "BlockStats.hpp"
+#include "Pyramid.hpp"
 #include "Player.hpp"
 #include "View.hpp"
 #include "Colormap.hpp"
@@ -40,6 +43,9 @@ Sequence::Sequence()
     collection = nullptr;
     uneditedCollection= nullptr;
     editGUI = new EditGUI();
+    previewScale = 1;
+    providerScale = 1;
+    imageScale = 1;
 
     valid = false;
 
@@ -197,10 +203,23 @@ void Sequence::tick()
         forgetImage();
     }
 
+    // show the preview of the provider until the image is loaded
+    if (imageprovider && !imageprovider->isLoaded() && !image) {
+        int scale;
+        std::shared_ptr<Image> preview = imageprovider->getPreview(scale);
+        if (preview) {
+            image = preview;
+            imageScale = scale;
+            error.clear();
+            gActive = std::max(gActive, 2);
+        }
+    }
+
     if (imageprovider && imageprovider->isLoaded()) {
         ImageProvider::Result result = imageprovider->getResult();
         if (result.has_value()) {
             image = result.value();
+            imageScale = providerScale;
             error.clear();
             LOG("new image: " << image);
         } else {
@@ -210,12 +229,18 @@ void Sequence::tick()
         }
         gActive = std::max(gActive, 2);
         imageprovider = nullptr;
-        if (image) {
+        // the histogram of a tiled image would decode all of it, only the regions are computed
+        if (image && !image->tiles) {
             auto mode = gSmoothHistogram ? Histogram::SMOOTH : Histogram::EXACT;
             image->histogram->request(image, mode);
         }
     }
 
+    // a zoomed-out view or the histogram read all the tiles anyway
+    if (image && image->tiles && (gShowHistogram || image->pyramid->getRequestedLevel() > 0)) {
+        requestWholeImage();
+    }
+
     if (image && colormap && !colormap->initialized) {
         colormap->autoCenterAndRadius(image->min, image->max);
 
@@ -238,18 +263,36 @@ void Sequence::tick()
     }
 }
 
-void Sequence::forgetImage()
+void Sequence::forgetImage(bool keepImage)
 {
     LOG("forget image, was=" << image << " provider=" << imageprovider);
-    image = nullptr;
+    if (!keepImage)
+        image = nullptr;
+    if (imageprovider) {
+        // the loading threads can drop it, unless another provider shares its work
+        imageprovider->cancel();
+    }
     if (player && collection) {
         int desiredFrame = getDesiredFrameIndex();
         imageprovider = collection->getImageProvider(desiredFrame - 1);
+        if (imageprovider) imageprovider->requestPreview();
+        providerScale = previewScale;
         loadedFrame = desiredFrame;
     }
     LOG("forget image, new provider=" << imageprovider);
 }
 
+void Sequence::requestWholeImage()
+{
+    if (!image || !image->tiles || !image->tiles->canComputeWhole() || imageprovider || !collection)
+        return;
+    if (wholeRequested.lock() == image)
+        return;
+    wholeRequested = image;
+    imageprovider = std::make_shared<WholeImageProvider>(image, collection->getKey(loadedFrame - 1));
+    providerScale = imageScale;
+}
+
 void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
 {
     std::shared_ptr<Image> img = getCurrentImage();
@@ -276,19 +319,46 @@ void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
             return;
     }
 
-    if (quantile == 0) {
+    // a tiled image can't be read completely, use its estimated range until the whole one is there
+    if (norange && img->tiles) {
+        requestWholeImage();
+    }
+    if (quantile == 0 || (norange && img->tiles)) {
         if (norange) {
-            low = img->min;
-            high = img->max;
+            // range of the displayed bands only
+            for (int d = 0; d < 3; d++) {
+                int b = bands[d];
+                if (b >= img->c)
+                    continue;
+                low = std::min(low, img->stats.bandmin[b]);
+                high = std::max(high, img->stats.bandmax[b]);
+            }
+            if (low > high) {
+                low = img->min;
+                high = img->max;
+            }
         } else {
-            const float* data = (const float*) img->pixels;
+            std::vector<size_t> used;
+            for (int d = 0; d < 3; d++) {
+                if (bands[d] < img->c) {
+                    used.push_back(bands[d]);
+                }
+            }
+            // the regions change often (pan and zoom), the blocks make them cheap
+            img->blocks->request(img);
+            if (img->blocks->getRange(*img, ImRect(p1, p2), used, low, high)) {
+                colormap->autoCenterAndRadius(low, high);
+                return;
+            }
+
+            std::vector<float> row(p2.x - p1.x);
             for (int d = 0; d < 3; d++) {
                 int b = bands[d];
                 if (b >= img->c)
                     continue;
                 for (int y = p1.y; y < p2.y; y++) {
-                    for (int x = p1.x; x < p2.x; x++) {
-                        float v = data[b + img->c*(x+y*img->w)];
+                    img->getSamples(b + img->c*((int)p1.x+y*img->w), row.size(), img->c, row.data());
+                    for (float v : row) {
                         if (std::isfinite(v)) {
                             low = std::min(low, v);
                             high = std::max(high, v);
@@ -298,53 +368,13 @@ void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
             }
         }
     } else {
-        std::vector<float> all;
-        const float* data = (const float*) img->pixels;
-        if (norange) {
-            if (img->c <= 3 && bands == BANDS_DEFAULT) {
-                // fast path
-                all = std::vector<float>(data, data+img->w*img->h*img->c);
-            } else {
-                for (int d = 0; d < 3; d++) {
-                    int b = bands[d];
-                    if (b >= img->c)
-                        continue;
-                    for (int y = 0; y < img->h; y++) {
-                        for (int x = 0; x < img->w; x++) {
-                            float v = data[b + img->c*(x+y*img->w)];
-                            all.push_back(v);
-                        }
-                    }
-                }
-            }
-        } else {
-            if (img->c <= 3 && bands == BANDS_DEFAULT) {
-                // fast path
-                for (int y = p1.y; y < p2.y; y++) {
-                    const float* start = &data[0 + img->c*((int)p1.x+y*img->w)];
-                    const float* end = &data[0 + img->c*((int)p2.x+y*img->w)];
-                    all.insert(all.end(), start, end);
-                }
-            } else {
-                for (int d = 0; d < 3; d++) {
-                    int b = bands[d];
-                    if (b >= img->c)
-                        continue;
-                    for (int y = p1.y; y < p2.y; y++) {
-                        for (int x = p1.x; x < p2.x; x++) {
-                            float v = data[b + img->c*(x+y*img->w)];
-                            all.push_back(v);
-                        }
-                    }
-                }
-            }
+        ImRect region(0, 0, img->w, img->h);
+        if (!norange) {
+            region = ImRect(p1, p2);
+            region.Floor();
         }
-        all.erase(std::remove_if(all.begin(), all.end(),
-                                 [](float x){return !std::isfinite(x);}),
-                  all.end());
-        std::sort(all.begin(), all.end());
-        low = all[quantile*all.size()];
-        high = all[(1-quantile)*all.size()];
+        if (!Quantiles::get(img, region, bands, quantile, low, high))
+            return;
     }
 
     colormap->autoCenterAndRadius(low, high);
@@ -376,18 +406,19 @@ std::shared_ptr<Image> Sequence::getCurrentImage() {
 
 float Sequence::getViewRescaleFactor() const
 {
+    // a preview is displayed at the size of the full resolution image
     if (!this->view->shouldRescale) {
-        return 1.;
+        return imageScale;
     }
 
     if (!this->view || !this->image) {
         return previousFactor;
     }
 
-    size_t largestW = image->w;
+    size_t largestW = image->w * imageScale;
     for (auto& seq : gSequences) {
-        if (view == seq->view && seq->image && largestW < seq->image->w) {
-            largestW = seq->image->w;
+        if (view == seq->view && seq->image && largestW < seq->image->w * seq->imageScale) {
+            largestW = seq->image->w * seq->imageScale;
         }
     }
     previousFactor = (float) largestW / image->w;
@@ -466,6 +497,18 @@ void Sequence::showInfo() const
         }
         ImGui::Text("Size: %lux%lux%lu", image->w, image->h, image->c);
         ImGui::Text("Range: %g..%g", image->min, image->max);
+        if (image->stats.nans || image->stats.infs) {
+            ImGui::Text("Non-finite: %lu NaN, %lu Inf", image->stats.nans, image->stats.infs);
+        }
+        if (image->c <= 4) {
+            std::string means;
+            for (double m : image->stats.bandmean) {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "%s%g", means.empty() ? "" : ", ", m);
+                means += buf;
+            }
+            ImGui::Text("Mean: %s", means.c_str());
+        }
         ImGui::Text("Zoom: %d%%", (int)(view->zoom * getViewRescaleFactor() * 100));
         ImGui::Separator();
 
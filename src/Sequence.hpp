@@ -43,6 +43,10 @@ struct Sequence {
 
     ImageCollection* uneditedCollection;
     EditGUI* editGUI;
+    // downscaling of the collection when it is a preview of an edit, 1 otherwise
+    int previewScale;
+    // downscaling of the displayed image
+    int imageScale;
 
     Sequence();
     ~Sequence();
@@ -50,7 +54,12 @@ struct Sequence {
     void loadFilenames();
 
     void tick();
-    void forgetImage();
+    // keepImage: the current image stays displayed until the new one is loaded
+    void forgetImage(bool keepImage=false);
+
+    // an image computed tile by tile is computed as a whole in the background, and replaces
+    // the displayed one when done, so that its histogram and statistics are exact
+    void requestWholeImage();
 
     void autoScaleAndBias(ImVec2 p1=ImVec2(0,0), ImVec2 p2=ImVec2(0,0), float quantile=0.);
     void snapScaleAndBias();
@@ -74,6 +83,11 @@ struct Sequence {
     bool putScriptSVG(const std::string& key, const std::string& buf);
 
 private:
+    // downscaling of the image being loaded
+    int providerScale;
+    // the tiled image whose whole version was asked, so that it is asked only once
+    std::weak_ptr<Image> wholeRequested;
+
     int getDesiredFrameIndex() const;
 };
 
@@ -1,11 +1,18 @@
 #include <list>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include <memory>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 
 #include <GL/gl3w.h>
 
 #include "Texture.hpp"
 #include "Image.hpp"
 #include "globals.hpp"
+#include "Progressable.hpp"
 
 const char* getGLError(GLenum error)
 {
@@ -37,29 +44,45 @@ const char* getGLError(GLenum error)
 
 static std::list<TextureTile> tileCache;
 
-static void initTile(TextureTile t)
+static GLuint getInternalFormat(unsigned format, unsigned type)
 {
-    GLuint internalFormat;
-    switch (t.format) {
-        case GL_RED:
-            internalFormat = GL_R32F;
-            break;
-        case GL_RG:
-            internalFormat = GL_RG32F;
+    switch (type) {
+        case GL_UNSIGNED_BYTE:
+            switch (format) {
+                case GL_RED: return GL_R8;
+                case GL_RG: return GL_RG8;
+                case GL_RGB: return GL_RGB8;
+                case GL_RGBA: return GL_RGBA8;
+            }
             break;
-        case GL_RGB:
-            internalFormat = GL_RGB32F;
+        case GL_UNSIGNED_SHORT:
+            switch (format) {
+                case GL_RED: return GL_R16;
+                case GL_RG: return GL_RG16;
+                case GL_RGB: return GL_RGB16;
+                case GL_RGBA: return GL_RGBA16;
+            }
             break;
-        case GL_RGBA:
-            internalFormat = GL_RGBA32F;
+        case GL_FLOAT:
+            switch (format) {
+                case GL_RED: return GL_R32F;
+                case GL_RG: return GL_RG32F;
+                case GL_RGB: return GL_RGB32F;
+                case GL_RGBA: return GL_RGBA32F;
+            }
             break;
-        default:
-            assert(0);
     }
+    assert(0);
+    return 0;
+}
+
+static void initTile(TextureTile t)
+{
+    GLuint internalFormat = getInternalFormat(t.format, t.type);
 
     glBindTexture(GL_TEXTURE_2D, t.id);
     GLDEBUG();
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, t.w, t.h, 0, t.format, GL_FLOAT, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, t.w, t.h, 0, t.format, t.type, NULL);
     GLDEBUG();
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -71,11 +94,12 @@ static void initTile(TextureTile t)
         case 1:
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
             break;
+        // the multiscale qualities are handled by the Pyramid of the images
         case 2:
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             break;
         case 3:
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
             break;
     }
     GLDEBUG();
@@ -88,11 +112,11 @@ static void initTile(TextureTile t)
     GLDEBUG();
 }
 
-static TextureTile takeTile(size_t w, size_t h, unsigned format)
+static TextureTile takeTile(size_t w, size_t h, unsigned format, unsigned type)
 {
     for (auto it = tileCache.begin(); it != tileCache.end(); it++) {
         TextureTile t = *it;
-        if (t.w == w && t.h == h && t.format == format) {
+        if (t.w == w && t.h == h && t.format == format && t.type == type) {
             tileCache.erase(it);
             return t;
         }
@@ -109,22 +133,266 @@ static TextureTile takeTile(size_t w, size_t h, unsigned format)
     tile.w = w;
     tile.h = h;
     tile.format = format;
+    tile.type = type;
     initTile(tile);
     return tile;
 }
 
-static void giveTile(TextureTile t)
+// pool of pixel buffers the uploads are streamed through
+// a buffer stays mapped while the upload thread fills it, then the driver reads it
+// asynchronously and a fence tells when it can be written again
+// a 4K frame in float takes 12 buffers, the pool can hold two of them in flight
+#define PIXEL_BUFFER_MAX 24
+
+struct PixelBuffer {
+    GLuint id;
+    GLsync fence;
+    size_t size;
+    bool mapped;
+};
+
+static std::vector<PixelBuffer> pixelBuffers;
+
+// whether the driver is done reading the buffer, never blocks
+static bool isPixelBufferFree(PixelBuffer& pbo)
 {
-    tileCache.push_back(t);
+    if (pbo.mapped)
+        return false;
+    if (pbo.fence) {
+        GLenum status = glClientWaitSync(pbo.fence, 0, 0);
+        GLDEBUG();
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            return false;
+        glDeleteSync(pbo.fence);
+        pbo.fence = 0;
+    }
+    return true;
 }
 
-void Texture::create(size_t w, size_t h, unsigned format)
+// maps a buffer of at least 'size' bytes for writing
+// returns its index in the pool, or -1 if all the buffers are being filled
+static int takePixelBuffer(size_t size, uint8_t** data)
 {
-    for (auto t : tiles) {
-        giveTile(t);
+    int idx = -1;
+    for (size_t i = 0; i < pixelBuffers.size() && idx < 0; i++) {
+        if (isPixelBufferFree(pixelBuffers[i]))
+            idx = i;
+    }
+    if (idx < 0 && pixelBuffers.size() < PIXEL_BUFFER_MAX) {
+        PixelBuffer pbo = {0, 0, 0, false};
+        glGenBuffers(1, &pbo.id);
+        GLDEBUG();
+        pixelBuffers.push_back(pbo);
+        idx = pixelBuffers.size() - 1;
+    }
+    if (idx < 0) {
+        // only blocks when the driver is a whole pool of uploads behind
+        for (size_t i = 0; i < pixelBuffers.size() && idx < 0; i++) {
+            PixelBuffer& pbo = pixelBuffers[i];
+            if (!pbo.mapped) {
+                glClientWaitSync(pbo.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+                GLDEBUG();
+                glDeleteSync(pbo.fence);
+                pbo.fence = 0;
+                idx = i;
+            }
+        }
+        if (idx < 0)
+            return -1;
     }
-    tiles.clear();
 
+    PixelBuffer& pbo = pixelBuffers[idx];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+    GLDEBUG();
+    if (pbo.size < size) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        GLDEBUG();
+        pbo.size = size;
+    }
+    *data = (uint8_t*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+                                        | GL_MAP_UNSYNCHRONIZED_BIT);
+    GLDEBUG();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    GLDEBUG();
+    if (!*data)
+        return -1;
+    pbo.mapped = true;
+    return idx;
+}
+
+// copies an area of the image to 'data', as rows of 'rowsize' bytes
+static void fillPixels(const Image& img, size_t sx, size_t sy, size_t iw, size_t ih,
+                       size_t rowsize, BandIndices bandidx, bool needsreshape, uint8_t* data)
+{
+    // the rows are written in order since the mapped memory is usually write-combined
+    if (!needsreshape) {
+        size_t ss = getSampleSize(img.type);
+        for (size_t y = 0; y < ih; y++) {
+            const uint8_t* src = (const uint8_t*) img.pixels + ((sy+y)*img.w + sx)*img.c*ss;
+            memcpy(data + y*rowsize, src, rowsize);
+        }
+    } else {
+        std::vector<float> band(iw);
+        std::vector<float> row(iw*3);
+        for (size_t y = 0; y < ih; y++) {
+            for (int c = 0; c < 3; c++) {
+                size_t b = bandidx[c];
+                if (b >= img.c) {
+                    std::fill(band.begin(), band.end(), 0.f);
+                } else {
+                    img.getSamples(((sy+y)*img.w+sx)*img.c+b, iw, img.c, band.data());
+                }
+                for (size_t x = 0; x < iw; x++) {
+                    row[x*3+c] = band[x];
+                }
+            }
+            memcpy(data + y*rowsize, row.data(), rowsize);
+        }
+    }
+}
+
+// copies the pixels to the tile, from the bound pixel buffer if 'data' is an offset
+static void uploadTile(unsigned id, size_t x, size_t y, size_t w, size_t h,
+                       unsigned glformat, unsigned gltype, const void* data)
+{
+    glBindTexture(GL_TEXTURE_2D, id);
+    GLDEBUG();
+
+    // rows of 8 and 16 bits images are not always aligned on 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLDEBUG();
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, glformat, gltype, data);
+    GLDEBUG();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLDEBUG();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GLDEBUG();
+}
+
+// fills a mapped pixel buffer on the upload thread
+// the UI thread unmaps it and uploads it to the tile once loaded
+struct TextureFill : public Progressable {
+    std::shared_ptr<Image> img;
+    size_t sx, sy, iw, ih, rowsize;
+    BandIndices bandidx;
+    bool needsreshape;
+    uint8_t* data;
+    std::atomic<bool> loaded;
+    // the tile got another use, the pixels are not uploaded
+    std::atomic<bool> discarded;
+
+    // only touched by the UI thread
+    Texture* owner;
+    int pbo;
+    unsigned tile;
+    size_t tx, ty;
+    unsigned glformat, gltype;
+
+    TextureFill() : loaded(false), discarded(false) {
+    }
+
+    float getProgressPercentage() const override {
+        return loaded ? 1.f : 0.f;
+    }
+
+    bool isLoaded() const override {
+        return loaded;
+    }
+
+    void progress() override {
+        if (!discarded) {
+            fillPixels(*img, sx, sy, iw, ih, rowsize, bandidx, needsreshape, data);
+        }
+        img = nullptr;
+        loaded = true;
+    }
+};
+
+namespace TextureUploads {
+
+    static std::mutex lock;
+    // fills not taken by the upload thread yet
+    static std::deque<std::shared_ptr<TextureFill>> queue;
+    // all the fills whose buffer is still mapped, in order, only used by the UI thread
+    static std::deque<std::shared_ptr<TextureFill>> inflight;
+
+    static void add(const std::shared_ptr<TextureFill>& fill)
+    {
+        inflight.push_back(fill);
+        std::lock_guard<std::mutex> _lock(lock);
+        queue.push_back(fill);
+    }
+
+    // older pixels must not overwrite the tile once it is reused
+    static void discard(unsigned tile)
+    {
+        for (auto& fill : inflight) {
+            if (fill->tile == tile) {
+                fill->discarded = true;
+            }
+        }
+    }
+
+    bool pending()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        return !queue.empty();
+    }
+
+    std::shared_ptr<Progressable> getNext()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        if (queue.empty())
+            return nullptr;
+        std::shared_ptr<TextureFill> fill = queue.front();
+        queue.pop_front();
+        return fill;
+    }
+
+    void flush()
+    {
+        // the upload thread fills the buffers in order
+        while (!inflight.empty() && inflight.front()->isLoaded()) {
+            std::shared_ptr<TextureFill> fill = inflight.front();
+            inflight.pop_front();
+
+            PixelBuffer& pbo = pixelBuffers[fill->pbo];
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+            GLDEBUG();
+            // the content is lost if the buffer got corrupted meanwhile
+            bool valid = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            GLDEBUG();
+            pbo.mapped = false;
+
+            if (valid && !fill->discarded) {
+                // the copy from the pixel buffer happens asynchronously
+                uploadTile(fill->tile, fill->tx, fill->ty, fill->iw, fill->ih,
+                           fill->glformat, fill->gltype, (const void*) 0);
+                pbo.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                GLDEBUG();
+                for (auto& t : fill->owner->tiles) {
+                    if (t.id == fill->tile) {
+                        t.ready = true;
+                    }
+                }
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            GLDEBUG();
+        }
+    }
+
+}
+
+static void giveTile(TextureTile t)
+{
+    TextureUploads::discard(t.id);
+    tileCache.push_back(t);
+}
+
+static size_t getTileSize()
+{
     static size_t ts = 0;
     if (!ts) {
         GLDEBUG();
@@ -134,27 +402,66 @@ void Texture::create(size_t w, size_t h, unsigned format)
         ts = _ts;
         ts = TEXTURE_MAX_SIZE;
     }
+    return ts;
+}
+
+void Texture::create(size_t w, size_t h, unsigned format, unsigned type)
+{
+    clear();
+
+    this->size.x = w;
+    this->size.y = h;
+    this->format = format;
+    this->type = type;
+}
+
+void Texture::allocateTiles(ImRect area)
+{
+    // tiles are only kept where the area needs them
+    // huge images would not fit in the video memory otherwise
+    for (auto it = tiles.begin(); it != tiles.end();) {
+        ImRect r(it->x, it->y, it->x+it->w, it->y+it->h);
+        if (!r.Overlaps(area)) {
+            giveTile(*it);
+            it = tiles.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    size_t ts = getTileSize();
+    size_t w = size.x;
+    size_t h = size.y;
     for (size_t y = 0; y < h; y += ts) {
         for (size_t x = 0; x < w; x += ts) {
             size_t tw = std::min(ts, w - x);
             size_t th = std::min(ts, h - y);
-            TextureTile t = takeTile(tw, th, format);
+            if (!ImRect(x, y, x+tw, y+th).Overlaps(area))
+                continue;
+            bool found = false;
+            for (auto& t : tiles) {
+                if (t.x == (int) x && t.y == (int) y) {
+                    found = true;
+                    break;
+                }
+            }
+            if (found)
+                continue;
+            TextureTile t = takeTile(tw, th, format, type);
             t.x = x;
             t.y = y;
             tiles.push_back(t);
         }
     }
-
-    this->size.x = w;
-    this->size.y = h;
-    this->format = format;
 }
 
 void Texture::upload(const std::shared_ptr<Image>& img, ImRect area, BandIndices bandidx)
 {
     GLDEBUG();
-    bool needsreshape = bandidx[0] != 0 || bandidx[1] != 1 || bandidx[2] != 2 || img->c > 3;
+    // tiled images have no contiguous buffer to upload from
+    bool needsreshape = bandidx[0] != 0 || bandidx[1] != 1 || bandidx[2] != 2 || img->c > 3 || img->tiles;
     unsigned int glformat = GL_RGB;
+    unsigned int gltype = GL_FLOAT;
     if (!needsreshape) {
         if (img->c == 1)
             glformat = GL_RED;
@@ -162,16 +469,22 @@ void Texture::upload(const std::shared_ptr<Image>& img, ImRect area, BandIndices
             glformat = GL_RG;
         else if (img->c == 3)
             glformat = GL_RGB;
+        // upload the native samples, the reshaped ones are converted to float
+        if (img->type == SAMPLE_UINT8)
+            gltype = GL_UNSIGNED_BYTE;
+        else if (img->type == SAMPLE_UINT16)
+            gltype = GL_UNSIGNED_SHORT;
     }
 
     size_t w = img->w;
     size_t h = img->h;
 
-    if (size.x != w || size.y != h || format != glformat) {
-        create(w, h, glformat);
+    if (size.x != w || size.y != h || format != glformat || type != gltype) {
+        create(w, h, glformat, gltype);
     }
+    allocateTiles(area);
 
-    for (auto t : tiles) {
+    for (auto& t : tiles) {
         ImRect intersect(t.x, t.y, t.x+t.w, t.y+t.h);
         intersect.ClipWithFull(area);
         ImRect totile = intersect;
@@ -181,60 +494,58 @@ void Texture::upload(const std::shared_ptr<Image>& img, ImRect area, BandIndices
             continue;
         }
 
-        const float* data;
-        if (!needsreshape) {
-            data = img->pixels + (w * (size_t)intersect.Min.y + (size_t)intersect.Min.x)*img->c;
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
-        } else {
-            // NOTE: all this copy and upload is slow
-            // 1) use opengl buffer to avoid pausing at each tile's upload
-            // 2° prepare the reshapebuffers in a thread
-            // storing these images as planar would help with cache
-            static float* reshapebuffer = new float[TEXTURE_MAX_SIZE*TEXTURE_MAX_SIZE*3];
-            for (int c = 0; c < 3; c++) {
-                size_t b = bandidx[c];
-                if (b >= img->c) {
-                    for (int y = 0; y < t.h; y++) {
-                        for (int x = 0; x < t.w; x++) {
-                            reshapebuffer[(y*TEXTURE_MAX_SIZE+x)*3+c] = 0;
-                        }
-                    }
-                    continue;
-                }
-                int sx = intersect.Min.x;
-                int sy = intersect.Min.y;
-                for (int y = 0; y < intersect.GetHeight(); y++) {
-                    for (int x = 0; x < intersect.GetWidth(); x++) {
-                        float v = img->pixels[((sy+y)*img->w+sx+x)*img->c+b];
-                        reshapebuffer[(y*TEXTURE_MAX_SIZE+x)*3+c] = v;
-                    }
-                }
-            }
-            data = reshapebuffer;
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, TEXTURE_MAX_SIZE);
-        }
+        size_t iw = intersect.GetWidth();
+        size_t ih = intersect.GetHeight();
+        size_t sx = intersect.Min.x;
+        size_t sy = intersect.Min.y;
+        size_t rowsize = iw * (needsreshape ? 3 * sizeof(float) : img->c * getSampleSize(img->type));
 
-        glBindTexture(GL_TEXTURE_2D, t.id);
-        GLDEBUG();
-
-        GLDEBUG();
-        glTexSubImage2D(GL_TEXTURE_2D, 0, totile.Min.x, totile.Min.y,
-                        totile.GetWidth(), totile.GetHeight(), glformat, GL_FLOAT, data);
-        GLDEBUG();
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-        GLDEBUG();
-
-        if (gDownsamplingQuality >= 2) {
-            glGenerateMipmap(GL_TEXTURE_2D);
-            GLDEBUG();
+        uint8_t* data;
+        int pbo = takePixelBuffer(rowsize * ih, &data);
+        if (pbo < 0) {
+            // no buffer to spare, fill and upload right away
+            std::vector<uint8_t> pixels(rowsize * ih);
+            fillPixels(*img, sx, sy, iw, ih, rowsize, bandidx, needsreshape, pixels.data());
+            TextureUploads::discard(t.id);
+            uploadTile(t.id, totile.Min.x, totile.Min.y, iw, ih, glformat, gltype, pixels.data());
+            t.ready = true;
+            continue;
         }
 
-        glBindTexture(GL_TEXTURE_2D, 0);
-        GLDEBUG();
+        auto fill = std::make_shared<TextureFill>();
+        fill->img = img;
+        fill->sx = sx;
+        fill->sy = sy;
+        fill->iw = iw;
+        fill->ih = ih;
+        fill->rowsize = rowsize;
+        fill->bandidx = bandidx;
+        fill->needsreshape = needsreshape;
+        fill->data = data;
+        fill->owner = this;
+        fill->pbo = pbo;
+        fill->tile = t.id;
+        fill->tx = totile.Min.x;
+        fill->ty = totile.Min.y;
+        fill->glformat = glformat;
+        fill->gltype = gltype;
+        TextureUploads::add(fill);
     }
 }
 
-Texture::~Texture()
+float Texture::getSampleScale() const
+{
+    switch (type) {
+        case GL_UNSIGNED_BYTE:
+            return 255.f;
+        case GL_UNSIGNED_SHORT:
+            return 65535.f;
+        default:
+            return 1.f;
+    }
+}
+
+void Texture::clear()
 {
     for (auto t : tiles) {
         giveTile(t);
@@ -242,3 +553,8 @@ Texture::~Texture()
     tiles.clear();
 }
 
+Texture::~Texture()
+{
+    clear();
+}
+
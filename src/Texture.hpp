@@ -14,19 +14,45 @@ struct TextureTile {
     int x, y;
     size_t w, h;
     unsigned format;
+    unsigned type;
+    // false until a first upload reaches the tile
+    bool ready = false;
 };
 
 struct Texture {
     std::vector<TextureTile> tiles;
     ImVec2 size;
     unsigned format = -1;
+    unsigned type = -1;
 
     ~Texture();
 
     void upload(const std::shared_ptr<Image>& img, ImRect area, BandIndices bandidx={0,1,2});
     ImVec2 getSize() { return size; }
+    // give back all the tiles
+    void clear();
+    // integer textures are normalized by OpenGL, this factor gives back the original values
+    float getSampleScale() const;
 
 private:
-    void create(size_t w, size_t h, unsigned format);
+    void create(size_t w, size_t h, unsigned format, unsigned type);
+    void allocateTiles(ImRect area);
 };
 
+class Progressable;
+
+// the pixel buffers of the uploads are filled by the upload thread,
+// the UI thread sends them to their textures at the next frame
+namespace TextureUploads {
+
+    // whether some pixel buffers are waiting to be filled
+    bool pending();
+
+    // next pixel buffer to fill, from the upload thread
+    std::shared_ptr<Progressable> getNext();
+
+    // sends the filled pixel buffers to their textures, from the UI thread
+    void flush();
+
+}
+
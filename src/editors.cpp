@@ -1,6 +1,14 @@
 #include <iostream>
+#include <cstring>
+#include <map>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <algorithm>
 
 #include "Image.hpp"
+#include "parallel.hpp"
 
 #include "plambda.h"
 #ifdef USE_GMIC
@@ -17,76 +25,347 @@
 
 #include "editors.hpp"
 
+#define PLAMBDA_CACHE_SIZE 8
+#define PLAMBDA_SAMPLES_PER_THREAD (1<<16)
+
+struct PlambdaProgram {
+    struct plambda_program* program;
+    bool reentrant;
+    // serializes the evaluations of non reentrant programs
+    std::mutex lock;
+
+    ~PlambdaProgram() {
+        plambda_free(program);
+    }
+};
+
+// compiled programs are kept by (number of inputs, program) since the same
+// edit is typically evaluated on every frame of a sequence
+static std::shared_ptr<PlambdaProgram> get_plambda_program(int n, const char* prog,
+                                                           std::string& error)
+{
+    static std::mutex lock;
+    static std::list<std::pair<std::string, std::shared_ptr<PlambdaProgram>>> cache;
+
+    std::string key = std::to_string(n) + " " + prog;
+    std::lock_guard<std::mutex> _lock(lock);
+    for (auto it = cache.begin(); it != cache.end(); it++) {
+        if (it->first == key) {
+            cache.splice(cache.begin(), cache, it);
+            return it->second;
+        }
+    }
+
+    char* err;
+    struct plambda_program* p = plambda_compile(n, (char*) prog, &err);
+    if (!p) {
+        error = std::string(err);
+        return 0;
+    }
+
+    std::shared_ptr<PlambdaProgram> program = std::make_shared<PlambdaProgram>();
+    program->program = p;
+    program->reentrant = plambda_is_reentrant(p);
+    cache.emplace_front(key, program);
+    if (cache.size() > PLAMBDA_CACHE_SIZE)
+        cache.pop_back();
+    return program;
+}
+
+// evaluates the whole frame, the bands of rows on the shared pool if the program allows it
+// the caller holds the lock of the program if it is not reentrant
+// returns nullptr and the error on failure
+static float* run_plambda_frame(PlambdaProgram& program, float** x, int* w, int* h, int* d, int dd,
+                                std::string& error)
+{
+    struct plambda_program* p = program.program;
+    size_t width = *w;
+    size_t height = *h;
+    float* pixels = (float*) malloc(sizeof(float) * width * height * dd);
+
+    // the errors are thread-local to the worker, copy them before it exits
+    auto run = [&](size_t j0, size_t j1, std::string& e) {
+        char* err;
+        if (!plambda_run_window(p, pixels + j0 * width * dd, dd, x, w, h, d,
+                                0, j0, width, j1 - j0, &err)) {
+            e = std::string(err);
+            return false;
+        }
+        return true;
+    };
+
+    // the first row is evaluated alone, it initializes the lazily
+    // configured sampling operators before the workers can race on them
+    if (height && !run(0, 1, error)) {
+        free(pixels);
+        return nullptr;
+    }
+
+    // the other rows are split in bands on the shared pool, if the program allows it
+    size_t rows = height > 0 ? height - 1 : 0;
+    size_t nthreads = 1;
+    if (program.reentrant) {
+        size_t rowsamples = std::max((size_t) 1, width * dd);
+        nthreads = parallel_chunks(rows, PLAMBDA_SAMPLES_PER_THREAD / rowsamples);
+    }
+
+    std::vector<std::string> errors(nthreads);
+    std::vector<char> ok(nthreads, true);
+    parallel_for(rows, nthreads, [&](size_t t, size_t j0, size_t j1) {
+        ok[t] = run(1 + j0, 1 + j1, errors[t]);
+    });
+
+    for (size_t t = 0; t < nthreads; t++) {
+        if (!ok[t]) {
+            error = errors[t];
+            free(pixels);
+            return nullptr;
+        }
+    }
+    return pixels;
+}
+
+// like the images loaded tile by tile, below this a whole frame fits in memory and is
+// evaluated faster at once, with exact statistics and histogram
+#define EDIT_TILED_MIN_PIXELS (8192*8192)
+#define EDIT_TILE_SIZE 512
+
+// evaluates the program only on the tiles that are accessed, so that editing a
+// large image only costs the area that is displayed
+// the sequence asks for the whole frame in the background when the histogram,
+// the statistics or a zoomed-out view need all of it (see computeWhole)
+struct PlambdaTileSource : TileSource {
+    std::shared_ptr<PlambdaProgram> program;
+    std::vector<std::shared_ptr<Image>> images;
+    std::vector<std::shared_ptr<const float>> floats;
+    std::vector<float*> x;
+    std::vector<int> w, h, d;
+    int dd;
+
+    PlambdaTileSource(std::shared_ptr<PlambdaProgram> program,
+                      const std::vector<std::shared_ptr<Image>>& images,
+                      const std::vector<std::shared_ptr<const float>>& floats,
+                      float** x, int* w, int* h, int* d, int dd)
+        : TileSource(EDIT_TILE_SIZE, EDIT_TILE_SIZE), program(program), images(images),
+          floats(floats), x(x, x + images.size()), w(w, w + images.size()),
+          h(h, h + images.size()), d(d, d + images.size()), dd(dd) {
+    }
+
+    std::shared_ptr<Image> readTile(size_t tx, size_t ty) {
+        size_t x0 = tx * tilew;
+        size_t y0 = ty * tileh;
+        size_t tw = std::min(tilew, w[0] - x0);
+        size_t th = std::min(tileh, h[0] - y0);
+
+        std::unique_lock<std::mutex> _lock(program->lock, std::defer_lock);
+        if (!program->reentrant)
+            _lock.lock();
+
+        char* err;
+        float* pixels = (float*) malloc(sizeof(float) * tw * th * dd);
+        if (!plambda_run_window(program->program, pixels, dd, x.data(), w.data(), h.data(), d.data(),
+                                x0, y0, tw, th, &err)) {
+            std::cerr << "plambda: " << err << std::endl;
+            free(pixels);
+            return nullptr;
+        }
+        return std::make_shared<Image>(pixels, tw, th, dd);
+    }
+
+    bool canComputeWhole() const {
+        return true;
+    }
+
+    std::shared_ptr<Image> computeWhole() {
+        std::unique_lock<std::mutex> _lock(program->lock, std::defer_lock);
+        if (!program->reentrant)
+            _lock.lock();
+
+        std::string error;
+        float* pixels = run_plambda_frame(*program, x.data(), w.data(), h.data(), d.data(), dd, error);
+        if (!pixels) {
+            std::cerr << "plambda: " << error << std::endl;
+            return nullptr;
+        }
+        return std::make_shared<Image>(pixels, w[0], h[0], dd);
+    }
+};
+
 static std::shared_ptr<Image> edit_images_plambda(const char* prog,
                               const std::vector<std::shared_ptr<Image>>& images,
                               std::string& error)
 {
     size_t n = images.size();
+    std::vector<std::shared_ptr<const float>> floats(n);
     float* x[n];
     int w[n];
     int h[n];
     int d[n];
     for (size_t i = 0; i < n; i++) {
         std::shared_ptr<Image> img = images[i];
-        x[i] = img->pixels;
+        // an input given several times is converted once
+        for (size_t j = 0; j < i && !floats[i]; j++) {
+            if (images[j] == img)
+                floats[i] = floats[j];
+        }
+        if (!floats[i])
+            floats[i] = img->getFloatPixels();
+        x[i] = (float*) floats[i].get();
         w[i] = img->w;
         h[i] = img->h;
         d[i] = img->c;
     }
 
-    int dd;
+    std::shared_ptr<PlambdaProgram> program = get_plambda_program(n, prog, error);
+    if (!program)
+        return 0;
+    struct plambda_program* p = program->program;
+
+    std::unique_lock<std::mutex> _lock(program->lock, std::defer_lock);
+    if (!program->reentrant)
+        _lock.lock();
+
     char* err;
-    float* pixels = execute_plambda(n, x, w, h, d, (char*) prog, &dd, &err);
-    if (!pixels) {
+    int dd = plambda_eval_dim(p, x, d, &err);
+    if (!dd) {
         error = std::string(err);
         return 0;
     }
 
+    size_t width = *w;
+    size_t height = *h;
+    if (width * height >= EDIT_TILED_MIN_PIXELS) {
+        // one pixel is evaluated here for the same reason as the first row below,
+        // the tiles are then evaluated concurrently by the loading and compute threads
+        float warmup[dd];
+        if (!plambda_run_window(p, warmup, dd, x, w, h, d, 0, 0, 1, 1, &err)) {
+            error = std::string(err);
+            return 0;
+        }
+        if (_lock.owns_lock())
+            _lock.unlock();
+        auto tiles = std::make_shared<PlambdaTileSource>(program, images, floats,
+                                                         (float**) x, (int*) w, (int*) h, (int*) d, dd);
+        return std::make_shared<Image>(tiles, width, height, dd, SAMPLE_FLOAT32);
+    }
+
+    float* pixels = run_plambda_frame(*program, x, w, h, d, dd, error);
+    if (!pixels)
+        return 0;
+
     std::shared_ptr<Image> img = std::make_shared<Image>(pixels, *w, *h, dd);
     return img;
 }
 
+#if defined(USE_GMIC) || defined(USE_OCTAVE)
+#define EDIT_SAMPLES_PER_THREAD (1<<18)
+
+// calls fn on bands of rows [y0, y1), on the shared pool
+static void parallel_rows(size_t h, size_t rowsamples,
+                          const std::function<void(size_t, size_t)>& fn)
+{
+    size_t nchunks = parallel_chunks(h, EDIT_SAMPLES_PER_THREAD / std::max(rowsamples, (size_t) 1));
+    parallel_for(h, nchunks, [&](size_t, size_t y0, size_t y1) {
+        fn(y0, y1);
+    });
+}
+
+#endif
+
+#ifdef USE_GMIC
+// the channel count is a constant so that the strided accesses can be vectorized
+template <size_t C>
+static void deinterleave_row(const float* in, size_t w, size_t c, float* out, size_t planestride)
+{
+    c = C ? C : c;
+    for (size_t z = 0; z < c; z++) {
+        float* plane = out + z * planestride;
+        for (size_t x = 0; x < w; x++) {
+            plane[x] = in[x * c + z];
+        }
+    }
+}
+
+template <size_t C>
+static void interleave_row(const float* in, size_t planestride, size_t w, size_t c, float* out)
+{
+    c = C ? C : c;
+    for (size_t z = 0; z < c; z++) {
+        const float* plane = in + z * planestride;
+        for (size_t x = 0; x < w; x++) {
+            out[x * c + z] = plane[x];
+        }
+    }
+}
+
+typedef void (*deinterleave_fn)(const float*, size_t, size_t, float*, size_t);
+typedef void (*interleave_fn)(const float*, size_t, size_t, size_t, float*);
+
+static void interleaved_to_planar(const float* in, size_t w, size_t h, size_t c,
+                                  float* out, size_t planestride)
+{
+    deinterleave_fn fn[] = {deinterleave_row<0>, deinterleave_row<1>, deinterleave_row<2>,
+                            deinterleave_row<3>, deinterleave_row<4>};
+    deinterleave_fn row = fn[c <= 4 ? c : 0];
+    parallel_rows(h, w * c, [&](size_t y0, size_t y1) {
+        for (size_t y = y0; y < y1; y++) {
+            row(in + y * w * c, w, c, out + y * w, planestride);
+        }
+    });
+}
+
+static void planar_to_interleaved(const float* in, size_t planestride, size_t w, size_t h, size_t c,
+                                  float* out)
+{
+    interleave_fn fn[] = {interleave_row<0>, interleave_row<1>, interleave_row<2>,
+                          interleave_row<3>, interleave_row<4>};
+    interleave_fn row = fn[c <= 4 ? c : 0];
+    parallel_rows(h, w * c, [&](size_t y0, size_t y1) {
+        for (size_t y = y0; y < y1; y++) {
+            row(in + y * w, planestride, w, c, out + y * w * c);
+        }
+    });
+}
+#endif
+
 static std::shared_ptr<Image> edit_images_gmic(const char* prog,
                                const std::vector<std::shared_ptr<Image>>& images,
                                std::string& error)
 {
 #ifdef USE_GMIC
-    gmic_list<char> images_names;
+    // parsing the stdlib is the most expensive part of a small edit, so each
+    // loading thread keeps its interpreter
+    static thread_local gmic interpreter;
     gmic_list<float> gimages;
+    gmic_list<char> images_names;
     gimages.assign(images.size());
     for (size_t i = 0; i < images.size(); i++) {
         std::shared_ptr<Image> img = images[i];
         gmic_image<float>& gimg = gimages[i];
         gimg.assign(img->w, img->h, 1, img->c);
-        const float* xptr = img->pixels;
-        for (size_t y = 0; y < img->h; y++) {
-            for (size_t x = 0; x < img->w; x++) {
-                for (size_t z = 0; z < img->c; z++) {
-                    gimg(x, y, 0, z) = *(xptr++);
-                }
-            }
-        }
+        std::shared_ptr<const float> floats = img->getFloatPixels();
+        interleaved_to_planar(floats.get(), img->w, img->h, img->c, gimg._data, img->w * img->h);
     }
 
     try {
-        gmic(prog, gimages, images_names);
+        interpreter.run(prog, gimages, images_names);
     } catch (gmic_exception &e) {
         error = e.what();
         std::cerr << "gmic: " << error << std::endl;
         return 0;
     }
 
+    if (!gimages._width) {
+        error = "no image left after the gmic program";
+        return 0;
+    }
+
+    // only the first slice of a volume is kept
     gmic_image<float>& image = gimages[0];
     size_t size = image._width * image._height * image._spectrum;
     float* data = (float*) malloc(sizeof(float) * size);
-    float* ptrdata = data;
-    for (size_t y = 0; y < image._height; y++) {
-        for (size_t x = 0; x < image._width; x++) {
-            for (size_t z = 0; z < image._spectrum; z++) {
-                *(ptrdata++) = image(x, y, 0, z);
-            }
-        }
-    }
+    size_t planestride = (size_t) image._width * image._height * image._depth;
+    planar_to_interleaved(image._data, planestride, image._width, image._height, image._spectrum, data);
 
     std::shared_ptr<Image> img = std::make_shared<Image>(data, image._width,
                                                         image._height, image._spectrum);
@@ -98,11 +377,64 @@ static std::shared_ptr<Image> edit_images_gmic(const char* prog,
 #endif
 }
 
-static std::shared_ptr<Image> edit_images_octave(const char* prog,
-                             const std::vector<std::shared_ptr<Image>>& images,
+#ifdef USE_OCTAVE
+#define TRANSPOSE_BLOCK 32
+#define OCTAVE_FUNCTION_CACHE_SIZE 16
+
+// interleaved rows to the column-major (y, x, z) layout of octave arrays,
+// by square blocks so that both sides stay in cache
+static void rows_to_columns(const float* in, size_t w, size_t h, size_t c, double* out)
+{
+    parallel_rows(h, w * c, [&](size_t y0, size_t y1) {
+        for (size_t bx = 0; bx < w; bx += TRANSPOSE_BLOCK) {
+            size_t bx1 = std::min(w, bx + TRANSPOSE_BLOCK);
+            for (size_t by = y0; by < y1; by += TRANSPOSE_BLOCK) {
+                size_t by1 = std::min(y1, by + TRANSPOSE_BLOCK);
+                for (size_t z = 0; z < c; z++) {
+                    for (size_t x = bx; x < bx1; x++) {
+                        double* col = out + (z * w + x) * h;
+                        for (size_t y = by; y < by1; y++) {
+                            col[y] = in[(y * w + x) * c + z];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+static void columns_to_rows(const double* in, size_t w, size_t h, size_t c, float* out)
+{
+    parallel_rows(h, w * c, [&](size_t y0, size_t y1) {
+        for (size_t by = y0; by < y1; by += TRANSPOSE_BLOCK) {
+            size_t by1 = std::min(y1, by + TRANSPOSE_BLOCK);
+            for (size_t bx = 0; bx < w; bx += TRANSPOSE_BLOCK) {
+                size_t bx1 = std::min(w, bx + TRANSPOSE_BLOCK);
+                for (size_t y = by; y < by1; y++) {
+                    for (size_t x = bx; x < bx1; x++) {
+                        for (size_t z = 0; z < c; z++) {
+                            out[(y * w + x) * c + z] = in[(z * w + x) * h + y];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+#endif
+
+// edits the frames in a single call of the octave function
+// with more than one frame, each argument is a 4D array (h, w, c, frames)
+// and the function has to return its result in the same way
+static std::vector<std::shared_ptr<Image>> edit_frames_octave(const char* prog,
+                             const std::vector<std::vector<std::shared_ptr<Image>>>& frames,
                              std::string& error)
 {
 #ifdef USE_OCTAVE
+    // the interpreter is not thread-safe, the loading threads take turns
+    static std::mutex lock;
+    std::lock_guard<std::mutex> _lock(lock);
+
 #if OCTAVE_MAJOR_VERSION == 4 && OCTAVE_MINOR_VERSION == 2 && OCTAVE_PATCH_VERSION == 2
     static octave::embedded_application* app;
 
@@ -114,7 +446,7 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
 
         if (!app->execute()) {
             std::cerr << "creating embedded Octave interpreter failed!" << std::endl;
-            return 0;
+            return {};
         }
     }
 #else
@@ -129,36 +461,53 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
     }
 #endif
 
+    // function handles by program, and input arrays reused while the size stays the same
+    static std::map<std::string, octave_value> functions;
+    static std::vector<NDArray> arrays;
+
+    size_t nframes = frames.size();
+    size_t n = frames[0].size();
 
     try {
         octave_value_list in;
 
         // create the function
-        octave_value_list in2;
-        in2(0) = octave_value(std::string(prog));
+        auto fit = functions.find(prog);
+        if (fit == functions.end()) {
+            if (functions.size() >= OCTAVE_FUNCTION_CACHE_SIZE)
+                functions.clear();
+            octave_value_list in2;
+            in2(0) = octave_value(std::string(prog));
 #if OCTAVE_MAJOR_VERSION == 4 && OCTAVE_MINOR_VERSION <= 4
-        octave_value_list fs = Fstr2func(in2);
+            octave_value_list fs = Fstr2func(in2);
 #else
-        octave_value_list fs = Fstr2func(*app, in2);
+            octave_value_list fs = Fstr2func(*app, in2);
 #endif
-        octave_function* f = fs(0).function_value();
+            fit = functions.emplace(prog, fs(0)).first;
+        }
+        octave_function* f = fit->second.function_value();
 
         // create the matrices
-        for (size_t i = 0; i < images.size(); i++) {
-            std::shared_ptr<Image> img = images[i];
+        if (arrays.size() < n)
+            arrays.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            std::shared_ptr<Image> img = frames[0][i];
             dim_vector size((int)img->h, (int)img->w, (int)img->c);
-            NDArray m(size);
+            if (nframes > 1) {
+                size.resize(4);
+                size(3) = nframes;
+            }
+            size.chop_trailing_singletons();
+            if (!(arrays[i].dims() == size))
+                arrays[i] = NDArray(size);
 
-            float* xptr = img->pixels;
-            for (size_t y = 0; y < img->h; y++) {
-                for (size_t x = 0; x < img->w; x++) {
-                    for (size_t z = 0; z < img->c; z++) {
-                        m(y, x, z) = *(xptr++);
-                    }
-                }
+            double* data = arrays[i].fortran_vec();
+            for (size_t k = 0; k < nframes; k++) {
+                std::shared_ptr<const float> floats = frames[k][i]->getFloatPixels();
+                rows_to_columns(floats.get(), img->w, img->h, img->c, data + k * img->w * img->h * img->c);
             }
 
-            in(i) = octave_value(m);
+            in(i) = octave_value(arrays[i]);
         }
 
         // eval
@@ -170,21 +519,26 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
 
         if (out.length() > 0) {
             NDArray m = out(0).array_value();
-            size_t w = m.cols();
-            size_t h = m.rows();
-            size_t d = m.ndims() == 3 ? m.pages() : 1;
-            size_t size = w * h * d;
-            float* data = (float*) malloc(sizeof(float) * size);
-            float* ptrdata = data;
-            for (size_t y = 0; y < h; y++) {
-                for (size_t x = 0; x < w; x++) {
-                    for (size_t z = 0; z < d; z++) {
-                        *(ptrdata++) = m(y, x, z);
-                    }
-                }
+            dim_vector dims = m.dims();
+            size_t h = dims(0);
+            size_t w = dims(1);
+            size_t d = dims.ndims() >= 3 ? dims(2) : 1;
+            size_t nreturned = dims.ndims() >= 4 ? dims(3) : 1;
+            if (nreturned != nframes) {
+                error = "octave returned " + std::to_string(nreturned) + " frames instead of "
+                        + std::to_string(nframes);
+                std::cerr << error << std::endl;
+                return {};
             }
-            std::shared_ptr<Image> img = std::make_shared<Image>(data, w, h, d);
-            return img;
+
+            std::vector<std::shared_ptr<Image>> images;
+            const double* data = m.data();
+            for (size_t k = 0; k < nframes; k++) {
+                float* pixels = (float*) malloc(sizeof(float) * w * h * d);
+                columns_to_rows(data + k * w * h * d, w, h, d, pixels);
+                images.push_back(std::make_shared<Image>(pixels, w, h, d));
+            }
+            return images;
         } else {
             error = "no image returned from octave";
             std::cerr << error << std::endl;
@@ -192,16 +546,26 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
 
     } catch (const octave::exit_exception& ex) {
         exit (ex.exit_status());
-        return 0;
+        return {};
 
     } catch (const octave::execution_exception& ex) {
         std::cerr << "octave execution_exception" << std::endl;
-        return 0;
+        return {};
     }
 #else
     fprintf(stderr, "not compiled with octave support\n");
 #endif
-    return 0;
+    return {};
+}
+
+static std::shared_ptr<Image> edit_images_octave(const char* prog,
+                             const std::vector<std::shared_ptr<Image>>& images,
+                             std::string& error)
+{
+    std::vector<std::shared_ptr<Image>> results = edit_frames_octave(prog, {images}, error);
+    if (results.empty())
+        return 0;
+    return results[0];
 }
 
 std::shared_ptr<Image> edit_images(EditType edittype, const std::string& _prog,
@@ -224,11 +588,59 @@ std::shared_ptr<Image> edit_images(EditType edittype, const std::string& _prog,
     return image;
 }
 
+std::string canonical_edit_program(EditType edittype, const std::string& prog)
+{
+    // plambda programs are tokens separated by the same characters as its tokenizer,
+    // without string literals
+    if (edittype != PLAMBDA)
+        return prog;
+    std::string canonical;
+    for (size_t i = 0; i < prog.size(); i++) {
+        if (prog[i] && strchr(" \n\t_", prog[i])) {
+            if (!canonical.empty() && canonical.back() != ' ')
+                canonical += ' ';
+        } else {
+            canonical += prog[i];
+        }
+    }
+    if (!canonical.empty() && canonical.back() == ' ')
+        canonical.pop_back();
+    return canonical;
+}
+
+std::vector<std::shared_ptr<Image>> edit_images_batch(EditType edittype, const std::string& prog,
+                                   const std::vector<std::vector<std::shared_ptr<Image>>>& frames,
+                                   std::string& error)
+{
+    // octave gets all the frames at once if they are stacked in 4D arrays
+    bool stackable = edittype == OCTAVE && frames.size() > 1;
+    for (size_t k = 1; stackable && k < frames.size(); k++) {
+        for (size_t i = 0; i < frames[0].size(); i++) {
+            const Image& a = *frames[0][i];
+            const Image& b = *frames[k][i];
+            if (a.w != b.w || a.h != b.h || a.c != b.c)
+                stackable = false;
+        }
+    }
+    if (stackable) {
+        return edit_frames_octave(prog.c_str(), frames, error);
+    }
+
+    std::vector<std::shared_ptr<Image>> images;
+    for (auto& frame : frames) {
+        std::shared_ptr<Image> image = edit_images(edittype, prog, frame, error);
+        if (!image)
+            return {};
+        images.push_back(image);
+    }
+    return images;
+}
+
 #include "ImageCollection.hpp"
 #include "Sequence.hpp"
 #include "globals.hpp"
 
-ImageCollection* create_edited_collection(EditType edittype, const std::string& _prog)
+ImageCollection* create_edited_collection(EditType edittype, const std::string& _prog, int downscale)
 {
     char* prog = (char*) _prog.c_str();
     std::vector<Sequence*> sequences;
@@ -252,6 +664,6 @@ ImageCollection* create_edited_collection(EditType edittype, const std::string&
     for (auto s : sequences) {
         collections.push_back(s->uneditedCollection);
     }
-    return new EditedImageCollection(edittype, std::string(prog), collections);
+    return new EditedImageCollection(edittype, std::string(prog), collections, downscale);
 }
 
@@ -16,5 +16,16 @@ std::shared_ptr<Image> edit_images(EditType edittype, const std::string& prog,
                                    const std::vector<std::shared_ptr<Image>>& images,
                                    std::string& error);
 
-class ImageCollection* create_edited_collection(EditType edittype, const std::string& prog);
+// the program with the differences that don't change its result removed,
+// so that equivalent edits share their cache entries
+std::string canonical_edit_program(EditType edittype, const std::string& prog);
+
+// edits several frames, the inner vectors being the inputs of each frame
+// octave evaluates them in a single call (see OCTAVE_BATCH)
+std::vector<std::shared_ptr<Image>> edit_images_batch(EditType edittype, const std::string& prog,
+                                   const std::vector<std::vector<std::shared_ptr<Image>>>& frames,
+                                   std::string& error);
+
+class ImageCollection* create_edited_collection(EditType edittype, const std::string& prog,
+                                               int downscale=1);
 
@@ -0,0 +1,44 @@
+// definitions of the globals, apart from main.cpp so that the benchmarks can link the rest of vpv
+#include <vector>
+#include <array>
+#include <atomic>
+
+#include "globals.hpp"
+#include "Terminal.hpp"
+
+std::vector<Sequence*> gSequences;
+std::vector<View*> gViews;
+std::vector<Player*> gPlayers;
+std::vector<Window*> gWindows;
+std::vector<Colormap*> gColormaps;
+std::vector<Shader*> gShaders;
+bool gSelecting;
+ImVec2 gSelectionFrom;
+ImVec2 gSelectionTo;
+bool gSelectionShown;
+ImVec2 gHoveredPixel;
+bool gUseCache;
+bool gShowHud;
+std::array<bool, 9> gShowSVGs;
+bool gShowMenuBar;
+bool gShowHistogram;
+bool gShowMiniview;
+int gShowWindowBar;
+int gWindowBorder;
+bool gShowImage;
+ImVec2 gDefaultSvgOffset;
+float gDefaultFramerate;
+int gDownsamplingQuality;
+size_t gCacheLimitMB;
+bool gPreload;
+bool gSmoothHistogram;
+bool gForceIioOpen;
+int gOctaveBatch;
+bool gJpegPreview;
+int gActive;
+std::atomic<int> gIdleLoaders(0);
+int gShowView;
+bool gReloadImages;
+static Terminal term;
+Terminal& gTerminal = term;
+
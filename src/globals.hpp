@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <array>
+#include <atomic>
 
 struct Sequence;
 struct View;
@@ -45,8 +46,12 @@ extern size_t gCacheLimitMB;
 extern bool gPreload;
 extern bool gSmoothHistogram;
 extern bool gForceIioOpen;
+extern int gOctaveBatch;
+extern bool gJpegPreview;
 
 extern int gActive;
+// loading threads waiting for work, a loader can use their cores for its own threads
+extern std::atomic<int> gIdleLoaders;
 extern int gShowView;
 #define MAX_SHOWVIEW 70
 extern bool gReloadImages;
@@ -1,4 +1,5 @@
 #include <string>
+#include <cstring>
 
 #include "Texture.hpp"
 #include "Image.hpp"
@@ -24,10 +25,10 @@ EOF
 
 static void load(void)
 {
-    float* pixels = (float*) malloc(sizeof(float)*W*H*C);
-    for (int i = 0; i < W*H*C; i++)
-        pixels[i] = (float) tileset[i] / 255.f;
-    std::shared_ptr<Image> image = std::make_shared<Image>(pixels, W, H, C);
+    // uploaded as 8 bits, so that OpenGL normalizes it to [0,1]
+    uint8_t* pixels = (uint8_t*) malloc(sizeof(uint8_t)*W*H*C);
+    memcpy(pixels, tileset, W*H*C);
+    std::shared_ptr<Image> image = std::make_shared<Image>(pixels, W, H, C, SAMPLE_UINT8);
     tex.upload(image, ImRect(0, 0, image->w, image->h));
 }
 
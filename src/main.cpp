@@ -32,49 +32,21 @@
 #include "config.hpp"
 #include "events.hpp"
 #include "LoadingThread.hpp"
+#include "Pyramid.hpp"
+#include "BlockStats.hpp"
 #include "ImageCache.hpp"
+#include "Prefetcher.hpp"
 #include "ImageProvider.hpp"
 #include "ImageCollection.hpp"
 #include "Histogram.hpp"
 #include "Terminal.hpp"
 #include "EditGUI.hpp"
 #include "menu.hpp"
+#include "Texture.hpp"
 
 #include "cousine_regular.c"
 
-std::vector<Sequence*> gSequences;
-std::vector<View*> gViews;
-std::vector<Player*> gPlayers;
-std::vector<Window*> gWindows;
-std::vector<Colormap*> gColormaps;
-std::vector<Shader*> gShaders;
-bool gSelecting;
-ImVec2 gSelectionFrom;
-ImVec2 gSelectionTo;
-bool gSelectionShown;
-ImVec2 gHoveredPixel;
-bool gUseCache;
-bool gShowHud;
-std::array<bool, 9> gShowSVGs;
-bool gShowMenuBar;
-bool gShowHistogram;
-bool gShowMiniview;
-int gShowWindowBar;
-int gWindowBorder;
-bool gShowImage;
-ImVec2 gDefaultSvgOffset;
-float gDefaultFramerate;
-int gDownsamplingQuality;
-size_t gCacheLimitMB;
-bool gPreload;
-bool gSmoothHistogram;
-bool gForceIioOpen;
 static bool showHelp = false;
-int gActive;
-int gShowView;
-bool gReloadImages;
-static Terminal term;
-Terminal& gTerminal = term;
 
 void help();
 void menu();
@@ -224,9 +196,9 @@ void parseArgs(int argc, char** argv)
         }
 
         if (isterm) {
-            strncpy(term.bufcommand, &arg[2], sizeof(term.bufcommand));
-            term.setVisible(true);
-            term.focusInput = false;
+            strncpy(gTerminal.bufcommand, &arg[2], sizeof(gTerminal.bufcommand));
+            gTerminal.setVisible(true);
+            gTerminal.focusInput = false;
         }
 
         if (isconfig) {
@@ -443,6 +415,8 @@ int main(int argc, char* argv[])
     gPreload = config::get_bool("PRELOAD");
     gSmoothHistogram = config::get_bool("SMOOTH_HISTOGRAM");
     gForceIioOpen = config::get_bool("FORCE_IIO_OPEN");
+    gOctaveBatch = std::max(1, config::get_int("OCTAVE_BATCH"));
+    gJpegPreview = config::get_bool("JPEG_PREVIEW");
 
     parseLayout(config::get_string("DEFAULT_LAYOUT"));
 
@@ -468,49 +442,56 @@ int main(int argc, char* argv[])
 
     relayout(true);
 
-    SleepyLoadingThread iothread([]() -> std::shared_ptr<Progressable> {
+    SleepyLoadingThreadPool iothread([]() -> std::shared_ptr<Progressable> {
         // fill the queue with images to be displayed
         for (auto seq : gSequences) {
             std::shared_ptr<Progressable> provider = seq->imageprovider;
-            if (provider && !provider->isLoaded()) {
+            if (provider && !provider->isLoaded() && !provider->isClaimed()) {
                 return provider;
             }
         }
 
-        if (!ImageCache::isFull()) {
-            // fill the queue with futur frames
-            for (int i = 1; i < 100; i++) {
-                for (auto seq : gSequences) {
-                    if (!seq->player)
-                        continue;
-                    ImageCollection* collection = seq->collection;
-                    if (!collection || collection->getLength() == 0)
-                        continue;
-                    int frame = (seq->player->frame + i - 1) % collection->getLength();
-                    if (frame == seq->player->frame - 1)
-                        continue;
-                    std::shared_ptr<ImageProvider> provider = collection->getImageProvider(frame);
-                    if (!provider->isLoaded()) {
-                        return provider;
-                    }
-                }
-            }
+        // tiles shown on screen come before prefetching
+        std::shared_ptr<Progressable> tile = TileRequests::getNext();
+        if (tile) {
+            return tile;
         }
-        return nullptr;
+
+        return Prefetcher::getNext();
     });
-    iothread.start();
+    int numLoaderThreads = config::get_int("LOADER_THREADS");
+    if (numLoaderThreads <= 0) {
+        numLoaderThreads = std::thread::hardware_concurrency();
+    }
+    iothread.start(numLoaderThreads);
 
     LoadingThread computethread([]() -> std::shared_ptr<Progressable> {
-        if (!gShowHistogram) return nullptr;
-        for (auto w : gWindows) {
-            std::shared_ptr<Progressable> provider = w->histogram;
+        for (auto seq : gSequences) {
+            if (!seq->image) continue;
+            std::shared_ptr<Progressable> provider = seq->image->pyramid;
             if (provider && !provider->isLoaded()) {
                 return provider;
             }
         }
+        if (gShowHistogram) {
+            for (auto w : gWindows) {
+                std::shared_ptr<Progressable> provider = w->histogram;
+                if (provider && !provider->isLoaded()) {
+                    return provider;
+                }
+            }
+            for (auto seq : gSequences) {
+                if (!seq->image) continue;
+                std::shared_ptr<Progressable> provider = seq->image->histogram;
+                if (provider && !provider->isLoaded()) {
+                    return provider;
+                }
+            }
+        }
+        // the blocks only speed up the region queries, they come last
         for (auto seq : gSequences) {
             if (!seq->image) continue;
-            std::shared_ptr<Progressable> provider = seq->image->histogram;
+            std::shared_ptr<Progressable> provider = seq->image->blocks;
             if (provider && !provider->isLoaded()) {
                 return provider;
             }
@@ -519,6 +500,12 @@ int main(int argc, char* argv[])
     });
     computethread.start();
 
+    // fills the pixel buffers of the textures, away from the UI thread
+    SleepyLoadingThread uploadthread([]() -> std::shared_ptr<Progressable> {
+        return TextureUploads::getNext();
+    });
+    uploadthread.start();
+
     if (gSequences.empty()) {
         showHelp = true;
     }
@@ -548,6 +535,12 @@ int main(int argc, char* argv[])
 
         watcher_check();
 
+        if (Prefetcher::update()) {
+            iothread.notify();
+        }
+        if (TileRequests::pending()) {
+            iothread.notify();
+        }
         for (auto seq : gSequences) {
             std::shared_ptr<Progressable> provider = seq->imageprovider;
             if (provider && !provider->isLoaded()) {
@@ -606,18 +599,23 @@ int main(int argc, char* argv[])
             p->update();
         }
 
+        // the buffers filled since the last frame
+        TextureUploads::flush();
         for (size_t i = 0; i < gWindows.size(); i++) {
             gWindows[i]->display();
         }
+        if (TextureUploads::pending()) {
+            uploadthread.notify();
+        }
 
         for (auto seq : gSequences) {
             seq->tick();
         }
 
         if (isKeyPressed("t")) {
-            term.setVisible(!term.shown);
+            gTerminal.setVisible(!gTerminal.shown);
         }
-        term.tick();
+        gTerminal.tick();
 
         if (isKeyPressed("F11")) {
             ImageCache::flush();
@@ -704,8 +702,12 @@ int main(int argc, char* argv[])
 
     iothread.stop();
     // do not join the iothread as it can be slow to exit
+    Prefetcher::flush();
     computethread.stop();
     computethread.join();
+    uploadthread.stop();
+    uploadthread.notify();
+    uploadthread.join();
 
 #define CLEAR(tab) \
     for (auto s : tab) \
@@ -859,6 +861,7 @@ void help()
             "\nPRELOAD = true"
             "\nCACHE = true"
             "\nCACHE_LIMIT = '2GB'"
+            "\nLOADER_THREADS = 0"
             "\nSCREENSHOT = 'screenshot_%d.png'"
             "\nWINDOW_WIDTH = 1024"
             "\nWINDOW_HEIGHT = 720"
@@ -885,6 +888,7 @@ void help()
     if (H("Misc.")) {
         B(); T("Setting WATCH to 1 enables the live reload mode. If the image is modified on the disk, then it will be reloaded in vpv so that the newest content will be displayed.");
         B(); T("Setting CACHE to 0 disables the caching of the images. This slows down vpv but also makes it use less RAM.");
+        B(); T("LOADER_THREADS sets the number of threads used to load images. 0 means one per core.");
         B(); T("SCALE allows to rescale vpv's interface (might be useful for high-density displays).");
         ImGui::Spacing();
         T("Shortcuts");
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "globals.hpp"
+#include "parallel.hpp"
+
+struct ParallelJob {
+    const std::function<void(size_t, size_t, size_t)>* fn;
+    size_t n;
+    size_t nchunks;
+    size_t chunk;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::mutex m;
+    std::condition_variable cv;
+
+    // takes chunks until there is none left
+    // a thread waiting for its own job can thus never be blocked by the others
+    void run() {
+        size_t i;
+        while ((i = next++) < nchunks) {
+            size_t begin = std::min(n, i * chunk);
+            size_t end = std::min(n, begin + chunk);
+            (*fn)(i, begin, end);
+            if (++done == nchunks) {
+                std::lock_guard<std::mutex> _lock(m);
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+// the workers are never stopped, the pool is leaked on purpose so that
+// they don't outlive its destruction at exit
+struct ParallelPool {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<ParallelJob>> jobs;
+    size_t nworkers;
+
+    ParallelPool() {
+        nworkers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        for (size_t i = 0; i < nworkers; i++) {
+            std::thread(&ParallelPool::work, this).detach();
+        }
+    }
+
+    void work() {
+        for (;;) {
+            std::shared_ptr<ParallelJob> job;
+            {
+                std::unique_lock<std::mutex> lk(m);
+                cv.wait(lk, [this]{ return !jobs.empty(); });
+                job = jobs.front();
+                // all its chunks are taken, the remaining ones are being finished
+                if (job->next >= job->nchunks) {
+                    jobs.pop_front();
+                    continue;
+                }
+            }
+            job->run();
+        }
+    }
+};
+
+static ParallelPool& getPool()
+{
+    static ParallelPool* pool = new ParallelPool;
+    return *pool;
+}
+
+size_t parallel_chunks(size_t n, size_t grain)
+{
+    size_t nthreads = 1 + std::min(getPool().nworkers, (size_t) std::max(0, (int) gIdleLoaders));
+    return std::max((size_t) 1, std::min(nthreads, n / std::max(grain, (size_t) 1)));
+}
+
+void parallel_for(size_t n, size_t nchunks, const std::function<void(size_t, size_t, size_t)>& fn)
+{
+    if (nchunks <= 1) {
+        for (size_t i = 0; i < nchunks; i++) {
+            fn(i, 0, n);
+        }
+        return;
+    }
+
+    auto job = std::make_shared<ParallelJob>();
+    job->fn = &fn;
+    job->n = n;
+    job->nchunks = nchunks;
+    job->chunk = (n + nchunks - 1) / nchunks;
+    job->next = 0;
+    job->done = 0;
+
+    ParallelPool& pool = getPool();
+    {
+        std::lock_guard<std::mutex> _lock(pool.m);
+        pool.jobs.push_back(job);
+    }
+    for (size_t i = 1; i < nchunks; i++) {
+        pool.cv.notify_one();
+    }
+
+    job->run();
+
+    std::unique_lock<std::mutex> lk(job->m);
+    job->cv.wait(lk, [&]{ return job->done == nchunks; });
+    lk.unlock();
+
+    // no worker got to it
+    std::lock_guard<std::mutex> _lock(pool.m);
+    auto it = std::find(pool.jobs.begin(), pool.jobs.end(), job);
+    if (it != pool.jobs.end())
+        pool.jobs.erase(it);
+}
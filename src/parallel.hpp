@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// data-parallel loops on a pool shared by the whole program
+// the calling thread always takes part, and only the cores of the idle loading
+// threads (see gIdleLoaders) are borrowed, so that concurrent loaders don't oversubscribe the machine
+
+// number of chunks that [0, n) should be split into, each having at least 'grain' items
+size_t parallel_chunks(size_t n, size_t grain);
+
+// calls fn(i, begin, end) for the 'nchunks' chunks of [0, n), the empty ones included
+// returns when all of them are done
+void parallel_for(size_t n, size_t nchunks, const std::function<void(size_t, size_t, size_t)>& fn);
+
@@ -5,6 +5,17 @@
 extern "C" {
 #endif
 
+struct plambda_program;
+
+struct plambda_program* plambda_compile(int n, char* program, char** error);
+void plambda_free(struct plambda_program* p);
+int plambda_is_reentrant(struct plambda_program* p);
+int plambda_eval_dim(struct plambda_program* p, float** x, int* pd,
+                     char** error);
+int plambda_run_window(struct plambda_program* p, float* out, int pdmax,
+                       float** x, int* w, int* h, int* pd,
+                       int i0, int j0, int ow, int oh, char** error);
+
 float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
                        char* program, int* od, char** error);
 
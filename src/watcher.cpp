@@ -20,6 +20,7 @@
 
 static efsw::FileWatcher* fileWatcher;
 static std::map<std::string, std::vector<std::pair<std::string, std::function<void(const std::string&)>>>> callbacks;
+static std::mutex callbacksLock;  // files are added from the loading threads
 static std::set<std::string> events;
 static std::mutex eventsLock;
 
@@ -65,11 +66,17 @@ void watcher_add_file(const std::string& filename, std::function<void(const std:
     char* d = dirname(dir);
     if (d != dir)
         strcpy(dir, d);
+    std::lock_guard<std::mutex> _lock(callbacksLock);
     fileWatcher->addWatch(dir, listener, false);
     callbacks[fullpath].push_back(std::make_pair(filename, clb));
     free(fullpath);
 }
 
+bool watcher_is_enabled(void)
+{
+    return fileWatcher != nullptr;
+}
+
 void watcher_check(void)
 {
     eventsLock.lock();
@@ -78,7 +85,12 @@ void watcher_check(void)
     eventsLock.unlock();
 
     for (auto& fullpath : eventsCopy) {
-        for (auto& clb : callbacks[fullpath]) {
+        std::vector<std::pair<std::string, std::function<void(const std::string&)>>> clbs;
+        {
+            std::lock_guard<std::mutex> _lock(callbacksLock);
+            clbs = callbacks[fullpath];
+        }
+        for (auto& clb : clbs) {
             clb.second(fullpath);
         }
     }
@@ -9,3 +9,5 @@ void watcher_add_file(const std::string& filename, std::function<void(const std:
 
 void watcher_check(void);
 
+bool watcher_is_enabled(void);
+
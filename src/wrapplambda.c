@@ -30,8 +30,7 @@ static void fail(const char *fmt, ...)
 #define HIDE_ALL_MAINS
 #include "plambda.c"
 
-float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
-					   char* program, int* opd, char** error)
+struct plambda_program* plambda_compile(int n, char* program, char** error)
 {
 	struct plambda_program* p = malloc(sizeof(*p));
 
@@ -55,14 +54,86 @@ float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
 			 "were given", p->var->n, n);
 
 	//print_compiled_program(p);
-	int pdreal = eval_dim(p, x, pd);
-
-	float *out = xmalloc(*w * *h * pdreal * sizeof*out);
-	*opd = run_program_vectorially(out, pdreal, p, x, w, h, pd);
-	assert(*opd == pdreal);
+	return p;
+}
 
+void plambda_free(struct plambda_program* p)
+{
 	collection_of_varnames_end(p->var);
 	free(p);
+}
+
+// magic variables fill a global cache on first use and the random
+// functions share a single generator state, so programs using them
+// have to be evaluated from one thread only
+int plambda_is_reentrant(struct plambda_program* p)
+{
+	for (int i = 0; i < p->n; i++) {
+		struct plambda_token *t = p->t + i;
+		if (t->type == PLAMBDA_MAGIC)
+			return 0;
+		if (t->type == PLAMBDA_OPERATOR && !strncmp("rand",
+				global_table_of_predefined_functions[t->index].name, 4))
+			return 0;
+	}
+	return 1;
+}
+
+int plambda_eval_dim(struct plambda_program* p, float** x, int* pd,
+					 char** error)
+{
+	if (setjmp(g_jmpbuf)) {
+		*error = g_error;
+		return 0;
+	}
+	return eval_dim(p, x, pd);
+}
+
+// evaluates the window of size ow x oh at (i0, j0) of the output into out,
+// the stack lives on the caller's stack so disjoint windows can be run
+// concurrently
+int plambda_run_window(struct plambda_program* p, float* out, int pdmax,
+					   float** x, int* w, int* h, int* pd,
+					   int i0, int j0, int ow, int oh, char** error)
+{
+	if (setjmp(g_jmpbuf)) {
+		*error = g_error;
+		return 0;
+	}
+
+	for (int j = 0; j < oh; j++)
+	for (int i = 0; i < ow; i++)
+	{
+		float *result = out + ((size_t) j * ow + i) * pdmax;
+		int r = run_program_vectorially_at(result, p, x, w, h, pd,
+				i0 + i, j0 + j);
+		if (r != pdmax) fail("r != pdmax");
+	}
+	return 1;
+}
+
+float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
+					   char* program, int* opd, char** error)
+{
+	struct plambda_program* p = plambda_compile(n, program, error);
+	if (!p)
+		return 0;
+
+	int pdreal = plambda_eval_dim(p, x, pd, error);
+	if (!pdreal) {
+		plambda_free(p);
+		return 0;
+	}
+
+	float *out = xmalloc(*w * *h * pdreal * sizeof*out);
+	if (!plambda_run_window(p, out, pdreal, x, w, h, pd, 0, 0, *w, *h, error)) {
+		free(out);
+		plambda_free(p);
+		return 0;
+	}
+	*opd = pdreal;
+
+	plambda_free(p);
 	return out;
 }
 